@@ -0,0 +1,451 @@
+/*
+ * bench.c
+ * Throughput benchmark of the tlv module over synthetic trees.
+ *
+ * Prints one tab separated line per shape and operation:
+ *   rev shape op nodes bytes reps seconds nodes/s bytes/s allocs/rep
+ * rev is the git revision the binary was built from, so output of
+ * different commits can be put side by side. bytes/s is "-" for
+ * operations that do not touch value bytes.
+ *
+ * usage: tlv-bench [scale]
+ *   scale: multiplies node counts of every shape, 1 by default
+ *
+ * Built by "make bench", which links it with -Wl,--wrap for the
+ * allocation functions so allocations made by tlv can be counted.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tlv.h"
+
+#ifndef BENCH_REV
+#define BENCH_REV "unknown"
+#endif
+
+// seconds each operation is repeated for, at least
+#define BENCH_MIN_SECONDS (0.2)
+#define BENCH_MAX_REPS (1000)
+
+
+////////////////////////////// ALLOCATION COUNTING BELOW //////////////////////////////
+
+static size_t allocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(p, size);
+}
+
+static size_t alloc_count()
+{
+    return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+////////////////////////////// ALLOCATION COUNTING ABOVE //////////////////////////////
+
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_SEED (20180608)
+
+static unsigned int seed = BENCH_SEED;
+
+/*
+ * same numbers on every run and every libc
+ */
+static size_t bench_rand()
+{
+    size_t r = 0;
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        r = (r << 15) | ((seed >> 16) & 0x7fff);
+    }
+
+    return r;
+}
+
+static void set_tag(tlv* t, tlvnode* node, size_t n)
+{
+    char tag[64];
+
+    if (t->tlength >= 16)
+    {
+        // long string tags, as main.c uses
+        snprintf(tag, sizeof(tag), "node %lu", (unsigned long)n);
+        tlv_node_write_t(t, node, (tlvbyte*)tag, strlen(tag) + 1);
+    }
+    else
+    {
+        tag[0] = (char)(n >> 8);
+        tag[1] = (char)n;
+        tlv_node_write_t(t, node, (tlvbyte*)tag, 2);
+    }
+}
+
+static tlvnode* make_leaf(tlv* t, size_t n, const tlvbyte* value, size_t vlength)
+{
+    tlvnode* node = tlv_node_obtain(t);
+
+    set_tag(t, node, n);
+    tlv_node_write_v(t, node, (tlvbyte*)value, vlength);
+
+    return node;
+}
+
+static tlvnode* make_structual(tlv* t, size_t n)
+{
+    tlvnode* node = tlv_node_obtain(t);
+
+    set_tag(t, node, n);
+    tlv_node_set_attributes(t, node, TLV_NODE_ATTR_IS_STRUCTUAL, 1);
+
+    return node;
+}
+
+/*
+ * balanced tree of count nodes, fanout children each,
+ * leaves get vlength bytes of value
+ */
+static tlv* make_balanced(size_t tlength, size_t count, size_t fanout, size_t vlength)
+{
+    tlv* t = tlv_obtain();
+    tlvbyte* value = (tlvbyte*)malloc(vlength + 1);
+    tlvnode** level;
+    size_t made = 1;
+    size_t levelcount = 1;
+    size_t i;
+
+    // the same value lengths every time the shape is built
+    seed = BENCH_SEED;
+
+    t->tlength = tlength;
+    t->llength = 4;
+    memset(value, 'v', vlength + 1);
+
+    level = (tlvnode**)malloc(sizeof(tlvnode*) * count);
+    level[0] = make_structual(t, 0);
+    tlv_set_root(t, level[0]);
+
+    // breadth first, the last level gets the leaves
+    while (made < count)
+    {
+        size_t next = 0;
+        tlvnode** nextlevel = (tlvnode**)malloc(sizeof(tlvnode*) * count);
+        int last = made + levelcount * fanout >= count;
+
+        for (i = 0; i < levelcount && made < count; i++)
+        {
+            size_t c;
+
+            for (c = 0; c < fanout && made < count; c++)
+            {
+                tlvnode* child = last
+                               ? make_leaf(t, made, value, vlength ? 1 + bench_rand() % vlength : 0)
+                               : make_structual(t, made);
+
+                tlv_node_add_child(t, level[i], child);
+                nextlevel[next++] = child;
+                made++;
+            }
+        }
+
+        free(level);
+        level = nextlevel;
+        levelcount = next;
+    }
+
+    free(level);
+    free(value);
+
+    return t;
+}
+
+/*
+ * chains of depth nodes hanging off root, count nodes in all
+ */
+static tlv* make_deep(size_t count, size_t depth)
+{
+    tlv* t = tlv_obtain();
+    tlvnode* root;
+    size_t made = 1;
+
+    t->llength = 4;
+    root = make_structual(t, 0);
+    tlv_set_root(t, root);
+
+    while (made < count)
+    {
+        size_t d;
+        tlvnode* top = make_leaf(t, made++, (const tlvbyte*)"deep", 4);
+
+        // built bottom up, so adding a child touches no ancestor above
+        for (d = 1; d < depth && made < count; d++)
+        {
+            tlvnode* parent = make_structual(t, made++);
+            tlv_node_add_child(t, parent, top);
+            top = parent;
+        }
+
+        tlv_node_add_child(t, root, top);
+    }
+
+    return t;
+}
+
+static tlv* build_wide(size_t scale)
+{
+    return make_balanced(2, 200000 * scale, 200000 * scale, 16);
+}
+
+static tlv* build_deep(size_t scale)
+{
+    return make_deep(100000 * scale, 1000);
+}
+
+static tlv* build_small_leaves(size_t scale)
+{
+    return make_balanced(2, 200000 * scale, 8, 4);
+}
+
+static tlv* build_huge_leaves(size_t scale)
+{
+    return make_balanced(2, 17, 16, 1024 * 1024 * scale);
+}
+
+static tlv* build_string_tags(size_t scale)
+{
+    return make_balanced(64, 50000 * scale, 16, 32);
+}
+
+typedef struct
+{
+    const char* shape;
+    tlv* (*build)(size_t scale); // same tree on every call
+    tlv* tlv;
+    size_t nodes;
+    size_t bytes;
+} bench_case;
+
+/*
+ * withbytes: none 0 if op reads or writes value bytes,
+ * bytes/s means nothing for the others
+ */
+static void report(const bench_case* c, const char* op, int withbytes,
+                   size_t reps, double seconds, size_t allocated)
+{
+    double per = seconds / reps;
+    char bytesrate[32] = "-";
+
+    if (withbytes)
+    {
+        snprintf(bytesrate, sizeof(bytesrate), "%.0f", c->bytes / per);
+    }
+
+    printf("%s\t%s\t%s\t%lu\t%lu\t%lu\t%.6f\t%.0f\t%s\t%.1f\n",
+            BENCH_REV, c->shape, op,
+            (unsigned long)c->nodes, (unsigned long)c->bytes, (unsigned long)reps,
+            per, c->nodes / per, bytesrate, (double)allocated / reps);
+    fflush(stdout);
+}
+
+static int visit(tlv* t, tlvnode* node)
+{
+    return 0;
+}
+
+/*
+ * repetitions to fill BENCH_MIN_SECONDS, from the time of one run
+ */
+static size_t reps_for(double once)
+{
+    size_t reps = once > 0 ? (size_t)(BENCH_MIN_SECONDS / once) + 1 : BENCH_MAX_REPS;
+    return reps < BENCH_MAX_REPS ? reps : BENCH_MAX_REPS;
+}
+
+/*
+ * layout of a freshly built tree, which has every path dirty.
+ * later layouts find nothing to do, so each rep builds the tree again,
+ * out of the timing
+ */
+static void run_layout(bench_case* c, size_t scale)
+{
+    tlv* t = c->build(scale);
+    size_t reps;
+    size_t i;
+    size_t a = 0;
+    double seconds = 0;
+    double start;
+
+    start = now();
+    tlv_layout(t);
+    reps = reps_for(now() - start);
+    tlv_destroy(t);
+
+    for (i = 0; i < reps; i++)
+    {
+        size_t before;
+
+        t = c->build(scale);
+        before = alloc_count();
+
+        start = now();
+        tlv_layout(t);
+        seconds += now() - start;
+        a += alloc_count() - before;
+
+        tlv_destroy(t);
+    }
+
+    report(c, "layout", 0, reps, seconds, a);
+}
+
+static void run_case(bench_case* c, size_t scale)
+{
+    tlvbyte* buf;
+    tlv** loaded;
+    size_t reps;
+    size_t i;
+    size_t a;
+    double start;
+    double once;
+
+    c->tlv = c->build(scale);
+    c->nodes = tlv_node_count(c->tlv);
+    c->bytes = tlv_layout(c->tlv);
+
+    run_layout(c, scale);
+
+    buf = (tlvbyte*)malloc(c->bytes);
+
+    start = now();
+    tlv_dumps(c->tlv, buf, c->bytes);
+    reps = reps_for(now() - start);
+
+    a = alloc_count();
+    start = now();
+    for (i = 0; i < reps; i++)
+    {
+        tlv_dumps(c->tlv, buf, c->bytes);
+    }
+    report(c, "dumps", 1, reps, now() - start, alloc_count() - a);
+
+    start = now();
+    tlv_node_traverse(c->tlv, visit);
+    reps = reps_for(now() - start);
+
+    a = alloc_count();
+    start = now();
+    for (i = 0; i < reps; i++)
+    {
+        tlv_node_traverse(c->tlv, visit);
+    }
+    report(c, "traverse", 0, reps, now() - start, alloc_count() - a);
+
+    // loads and destroy share the trees, so both run the same reps
+    loaded = (tlv**)malloc(sizeof(tlv*));
+    loaded[0] = tlv_obtain();
+    loaded[0]->tlength = c->tlv->tlength;
+    loaded[0]->llength = c->tlv->llength;
+    start = now();
+    tlv_loads(loaded[0], buf, c->bytes);
+    once = now() - start;
+    tlv_destroy(loaded[0]);
+    free(loaded);
+
+    reps = reps_for(once);
+    loaded = (tlv**)malloc(sizeof(tlv*) * reps);
+    for (i = 0; i < reps; i++)
+    {
+        loaded[i] = tlv_obtain();
+        loaded[i]->tlength = c->tlv->tlength;
+        loaded[i]->llength = c->tlv->llength;
+    }
+
+    a = alloc_count();
+    start = now();
+    for (i = 0; i < reps; i++)
+    {
+        tlv_loads(loaded[i], buf, c->bytes);
+    }
+    report(c, "loads", 1, reps, now() - start, alloc_count() - a);
+
+    a = alloc_count();
+    start = now();
+    for (i = 0; i < reps; i++)
+    {
+        tlv_node_destroy(loaded[i], loaded[i]->root);
+        loaded[i]->root = NULL;
+    }
+    report(c, "node_destroy", 0, reps, now() - start, alloc_count() - a);
+
+    for (i = 0; i < reps; i++)
+    {
+        tlv_destroy(loaded[i]);
+    }
+
+    free(loaded);
+    free(buf);
+    tlv_destroy(c->tlv);
+}
+
+int main(int argc, char** argv)
+{
+    size_t scale = argc > 1 ? (size_t)atoi(argv[1]) : 1;
+    bench_case cases[5];
+    size_t i;
+
+    if (scale == 0)
+    {
+        scale = 1;
+    }
+
+    cases[0].shape = "wide";
+    cases[0].build = build_wide;
+    cases[1].shape = "deep";
+    cases[1].build = build_deep;
+    cases[2].shape = "small_leaves";
+    cases[2].build = build_small_leaves;
+    cases[3].shape = "huge_leaves";
+    cases[3].build = build_huge_leaves;
+    cases[4].shape = "string_tags";
+    cases[4].build = build_string_tags;
+
+    printf("rev\tshape\top\tnodes\tbytes\treps\tseconds\tnodes_per_s\tbytes_per_s\tallocs_per_rep\n");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        run_case(&cases[i], scale);
+    }
+
+    return 0;
+}
@@ -161,15 +161,7 @@ tlv* make_test_tlv()
 
 void write_tlv_to_file(tlv* tlv, const char* path)
 {
-    FILE* fp = fopen(path, "w");
-    tlvbyte* buf = (tlvbyte*) malloc(sizeof(tlvbyte) * tlv->dumplength);
-
-    memset(buf, 0x00, tlv->dumplength);
-    tlv_dumps(tlv, buf, tlv->dumplength);
-    fwrite(buf, tlv->dumplength, 1, fp);
-
-    free(buf);
-    fclose(fp); 
+    tlv_dump_file(tlv, path);
 }
 
 
@@ -178,18 +170,39 @@ tlv* read_tlv_from_file(const char* path)
     tlv* tlv = tlv_obtain();
     tlv->tlength = TAG_LEN;
 
-    FILE* fp = fopen(path, "rb");
-    tlvbyte buf[4096];
-    memset(buf, 0x00, sizeof(buf));
-
-    fread(buf, sizeof(buf), 1, fp);
-    tlv_loads(tlv, buf, sizeof(buf));
-    fclose(fp); 
+    tlv_load_file(tlv, path);
 
     return tlv;
 }
 
 
+/*
+ * prints nothing unless tlv is built with TLV_ENABLE_STATS
+ */
+void print_tlv_stats(const char* name, const tlv* tlv)
+{
+    tlv_stats stats;
+
+    if (tlv_stats_snapshot(tlv, &stats))
+    {
+        return;
+    }
+
+    printf("\n%s stats:\n", name);
+    printf("    nodes created %lu, destroyed %lu\n",
+            (unsigned long)stats.nodescreated, (unsigned long)stats.nodesdestroyed);
+    printf("    allocs %lu, %lu bytes\n",
+            (unsigned long)stats.allocs, (unsigned long)stats.allocbytes);
+    printf("    bytes copied on load %lu, on dump %lu\n",
+            (unsigned long)stats.loadbytes, (unsigned long)stats.dumpbytes);
+    printf("    layouts %lu, nodes rewritten %lu\n",
+            (unsigned long)stats.layouts, (unsigned long)stats.layoutnodes);
+    printf("    peak depth %lu\n", (unsigned long)stats.peakdepth);
+    printf("    ns in loads %llu, dumps %llu, layout %llu, traverse %llu, destroy %llu\n",
+            stats.loadsns, stats.dumpsns, stats.layoutns, stats.traversens, stats.destroyns);
+}
+
+
 int main()
 {
     tlv* t = make_test_tlv();
@@ -227,6 +240,10 @@ int main()
 
     //write_tlv_to_file(t1, "tlv.out");
 
+    print_tlv_stats("t", t);
+    print_tlv_stats("t1", t1);
+    print_tlv_stats("t2", t2);
+
     tlv_destroy(t);
     tlv_destroy(t1);
 
@@ -0,0 +1,1207 @@
+/*
+ * test.c
+ * Round trip and rejection checks of the tlv module.
+ *
+ * Every check that fails prints its line, and the exit status is
+ * non zero if any did. Built by "make test" with AddressSanitizer and
+ * UndefinedBehaviorSanitizer, so an out of bounds access or a leak
+ * fails the run too.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tlv.h"
+
+#define TEST_BIG_VALUE (300) // bytes of the compressible leaf of the sample
+
+static int failures = 0;
+
+#define CHECK(cond) check((cond) != 0, #cond, __LINE__)
+
+static void check(int ok, const char* what, int line)
+{
+    if (!ok)
+    {
+        failures++;
+        fprintf(stderr, "test.c:%d: check failed: %s\n", line, what);
+    }
+}
+
+
+////////////////////////////// TREE HELPERS BELOW //////////////////////////////
+
+/*
+ * blank tlv of the given geometry
+ */
+static tlv* geometry(size_t alength, size_t tlength, size_t llength,
+                     tlv_byte_prio_order_t byteprio, int varint)
+{
+    tlv* t = tlv_obtain();
+
+    t->alength = alength;
+    t->tlength = tlength;
+    t->llength = llength;
+    t->byteprio = byteprio;
+    t->varint = varint;
+
+    return t;
+}
+
+static tlv* geometry_of(const tlv* def)
+{
+    tlv* t = geometry(def->alength, def->tlength, def->llength, def->byteprio, def->varint);
+
+    t->loadmode = def->loadmode;
+    t->compress = def->compress;
+
+    return t;
+}
+
+/*
+ * tag n in the last two bytes, zero padded to tlength
+ */
+static void tag_of(const tlv* t, unsigned int n, tlvbyte* tag)
+{
+    memset(tag, 0, t->tlength);
+    tag[t->tlength - 1] = (tlvbyte)n;
+    if (t->tlength > 1)
+    {
+        tag[t->tlength - 2] = (tlvbyte)(n >> 8);
+    }
+}
+
+static tlvnode* leaf(tlv* t, unsigned int n, const void* value, size_t vlength)
+{
+    tlvnode* node = tlv_node_obtain(t);
+    tlvbyte tag[8];
+
+    tag_of(t, n, tag);
+    tlv_node_write_t(t, node, tag, t->tlength);
+    tlv_node_write_v(t, node, (tlvbyte*)value, vlength);
+
+    return node;
+}
+
+static tlvnode* structual(tlv* t, unsigned int n)
+{
+    tlvnode* node = tlv_node_obtain(t);
+    tlvbyte tag[8];
+
+    tag_of(t, n, tag);
+    tlv_node_write_t(t, node, tag, t->tlength);
+    tlv_node_set_attributes(t, node, TLV_NODE_ATTR_IS_STRUCTUAL, 1);
+
+    return node;
+}
+
+static tlvnode* child(tlv* t, tlvnode* parent, unsigned int n)
+{
+    tlvbyte tag[8];
+
+    tag_of(t, n, tag);
+    return tlv_node_find_child(t, parent, tag, t->tlength);
+}
+
+static void big_value(tlvbyte* value)
+{
+    size_t i;
+
+    for (i = 0; i < TEST_BIG_VALUE; i++)
+    {
+        value[i] = "abcabd"[i % 6];
+    }
+}
+
+/*
+ * sample tree on t, preorder tags are 1 2 3 4 5 6 7 8 0x1234:
+ * 1 ( 2 ( 3 "hello", 4 "" ), 5 big, 6 ( 7 ( 8 "x" ) ), 0x1234 "tail" )
+ */
+static void make_sample(tlv* t)
+{
+    tlvbyte big[TEST_BIG_VALUE];
+    tlvnode* root = structual(t, 1);
+    tlvnode* n2 = structual(t, 2);
+    tlvnode* n6 = structual(t, 6);
+    tlvnode* n7 = structual(t, 7);
+
+    big_value(big);
+
+    tlv_set_root(t, root);
+    tlv_node_add_child(t, root, n2);
+    tlv_node_add_child(t, n2, leaf(t, 3, "hello", 5));
+    tlv_node_add_child(t, n2, leaf(t, 4, "", 0));
+    tlv_node_add_child(t, root, leaf(t, 5, big, sizeof(big)));
+    tlv_node_add_child(t, root, n6);
+    tlv_node_add_child(t, n6, n7);
+    tlv_node_add_child(t, n7, leaf(t, 8, "x", 1));
+    tlv_node_add_child(t, root, leaf(t, 0x1234, "tail", 4));
+}
+
+/*
+ * layout and dump t into a buffer of its own
+ */
+static tlvbyte* dump(tlv* t, size_t* size)
+{
+    tlvbyte* buf;
+
+    *size = tlv_layout(t);
+    buf = (tlvbyte*)malloc(*size);
+    CHECK(tlv_dumps(t, buf, *size) == *size);
+
+    return buf;
+}
+
+/*
+ * t dumps to exactly size bytes at bytes
+ */
+static int dumps_as(tlv* t, const tlvbyte* bytes, size_t size)
+{
+    size_t got;
+    tlvbyte* buf = dump(t, &got);
+    int same = got == size && memcmp(buf, bytes, size) == 0;
+
+    free(buf);
+
+    return same;
+}
+
+static size_t temp_file(char* path, const tlvbyte* bytes, size_t size)
+{
+    int fd;
+    size_t done = 0;
+
+    strcpy(path, "/tmp/tlv-test-XXXXXX");
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    while (done < size)
+    {
+        ssize_t n = write(fd, bytes + done, size - done);
+        if (n <= 0)
+        {
+            break;
+        }
+
+        done += n;
+    }
+
+    close(fd);
+
+    return done;
+}
+
+////////////////////////////// TREE HELPERS ABOVE //////////////////////////////
+
+
+/*
+ * dump -> load -> dump of the sample, in every load mode, with and
+ * without an arena, over a few fixed geometries and every varint mode
+ */
+static void test_roundtrip()
+{
+    static const size_t geometries[][3] = {
+        { 1, 2, 2 }, { 1, 1, 4 }, { 2, 4, 2 }, { 1, 2, 3 }
+    };
+    size_t g;
+    int varint;
+    int mode;
+    int arena;
+
+    for (g = 0; g < sizeof(geometries) / sizeof(geometries[0]); g++)
+    {
+        for (varint = TLV_VARINT_NONE; varint <= (TLV_VARINT_T | TLV_VARINT_L); varint++)
+        {
+            tlv_byte_prio_order_t byteprio = g % 2 ? TLV_BYTE_LSB : TLV_BYTE_MSB;
+            tlv* t = geometry(geometries[g][0], geometries[g][1], geometries[g][2], byteprio, varint);
+            tlvbyte* bytes;
+            size_t size;
+
+            make_sample(t);
+            bytes = dump(t, &size);
+            CHECK(tlv_node_count(t) == 9);
+
+            for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_LAZY; mode++)
+            {
+                for (arena = 0; arena <= 1; arena++)
+                {
+                    tlv* l = geometry_of(t);
+                    tlvnode* hello;
+                    tlvbyte buf[8];
+
+                    l->loadmode = mode;
+                    if (arena)
+                    {
+                        CHECK(tlv_use_arena(l, 0) == 0);
+                    }
+
+                    CHECK(tlv_loads(l, bytes, size) == size);
+                    CHECK(tlv_node_count(l) == 9);
+                    CHECK(dumps_as(l, bytes, size));
+
+                    // finding a leaf materializes its ancestors in lazy mode
+                    hello = child(l, child(l, l->root, 2), 3);
+                    CHECK(tlv_node_read_v(l, hello, buf, sizeof(buf)) == 5);
+                    CHECK(memcmp(buf, "hello", 5) == 0);
+
+                    // writes never reach the bytes a view tree was loaded from
+                    tlv_node_write_v(l, hello, (tlvbyte*)"HELLO", 5);
+                    CHECK(!dumps_as(l, bytes, size));
+                    CHECK(dumps_as(t, bytes, size));
+
+                    tlv_destroy(l);
+                }
+            }
+
+            free(bytes);
+            tlv_destroy(t);
+        }
+    }
+}
+
+/*
+ * bytes fed to a decoder in pieces of every size build the same tree,
+ * a cut message waits for more, a child overrunning its parent fails
+ */
+static void test_decoder()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvbyte* bytes;
+    tlvbyte* bad;
+    size_t size;
+    size_t piece;
+    size_t fed;
+    size_t consumed;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+
+    for (piece = 1; piece <= size; piece++)
+    {
+        tlv* l = geometry_of(t);
+        tlv_decoder* dec = tlv_decoder_obtain(l);
+        tlv_decode_status_t status = TLV_DECODE_NEED_MORE;
+
+        for (fed = 0; fed < size && status == TLV_DECODE_NEED_MORE; fed += consumed)
+        {
+            size_t n = size - fed < piece ? size - fed : piece;
+
+            status = tlv_decoder_feed(dec, bytes + fed, n, &consumed);
+        }
+
+        CHECK(status == TLV_DECODE_COMPLETE && fed == size);
+        CHECK(tlv_decoder_need(dec) == 0);
+        CHECK(dumps_as(l, bytes, size));
+
+        tlv_decoder_destroy(dec);
+        tlv_destroy(l);
+    }
+
+    // a cut message, dropped half way with the decoder
+    {
+        tlv* l = geometry_of(t);
+        tlv_decoder* dec = tlv_decoder_obtain(l);
+
+        CHECK(tlv_decoder_feed(dec, bytes, size - 3, &consumed) == TLV_DECODE_NEED_MORE);
+        CHECK(consumed == size - 3 && tlv_decoder_need(dec) == 3);
+
+        tlv_decoder_destroy(dec);
+        tlv_destroy(l);
+    }
+
+    // first child overruns the root
+    bad = (tlvbyte*)malloc(size);
+    memcpy(bad, bytes, size);
+    bad[5 + 3] = 0xff;
+    bad[5 + 4] = 0xff;
+    {
+        tlv* l = geometry_of(t);
+        tlv_decoder* dec = tlv_decoder_obtain(l);
+
+        CHECK(tlv_decoder_feed(dec, bad, size, NULL) == TLV_DECODE_ERROR);
+
+        tlv_decoder_destroy(dec);
+        tlv_destroy(l);
+    }
+
+    free(bad);
+    free(bytes);
+    tlv_destroy(t);
+}
+
+static int count_flat(tlv_flat* flat, size_t index)
+{
+    return 0;
+}
+
+/*
+ * indexed lookups find what walking the tree does, and follow edits
+ */
+static void test_index()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvbyte* bytes;
+    tlvnode* found[4];
+    tlvbyte tag[2];
+    size_t size;
+    int mode;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+
+    for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_LAZY; mode++)
+    {
+        tlv* l = geometry_of(t);
+        tlvnode* n6;
+
+        l->loadmode = mode;
+        CHECK(tlv_use_index(l) == 0);
+        CHECK(tlv_loads(l, bytes, size) == size);
+
+        n6 = child(l, l->root, 6);
+        CHECK(n6 && child(l, n6, 7) && !child(l, l->root, 7));
+
+        tag_of(l, 8, tag);
+        CHECK(tlv_node_find_descendants(l, l->root, tag, 2, found, 4) == 1);
+        CHECK(found[0] == child(l, child(l, n6, 7), 8));
+
+        // retagged, then moved under another parent
+        tag_of(l, 9, tag);
+        tlv_node_write_t(l, n6, tag, 2);
+        CHECK(!child(l, l->root, 6) && child(l, l->root, 9) == n6);
+
+        tlv_node_remove_child(l, n6);
+        tlv_node_add_child(l, child(l, l->root, 2), n6);
+        CHECK(!child(l, l->root, 9) && child(l, child(l, l->root, 2), 9) == n6);
+        tag_of(l, 8, tag);
+        CHECK(tlv_node_find_descendants(l, child(l, l->root, 2), tag, 2, found, 4) == 1);
+
+        tlv_destroy(l);
+    }
+
+    // the children of a lazy node that cannot be decoded are not found
+    bytes[5 + 3] = 0xff;
+    bytes[5 + 4] = 0xff;
+    {
+        tlv* l = geometry_of(t);
+
+        l->loadmode = TLV_LOAD_LAZY;
+        CHECK(tlv_loads(l, bytes, size) == size);
+        CHECK(child(l, l->root, 2) == NULL);
+        tlv_destroy(l);
+    }
+
+    free(bytes);
+    tlv_destroy(t);
+}
+
+/*
+ * flat trees dump as the node tree does, and never past buf
+ */
+static void test_flat()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlv_flat* flat = tlv_flat_obtain(t);
+    tlvbyte grown[200];
+    tlvbyte* stale;
+    tlvbyte* bytes;
+    tlvbyte* buf;
+    size_t dumped;
+    size_t size;
+    size_t i;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+    dumped = size;
+
+    CHECK(tlv_flat_from_tree(flat, t) == 0);
+    CHECK(flat->count == 9);
+    CHECK(tlv_flat_traverse(flat, count_flat) == 9);
+    CHECK(tlv_flat_layout(flat) == size);
+
+    buf = (tlvbyte*)malloc(size + sizeof(grown));
+    CHECK(tlv_flat_dumps(flat, buf, size) == size);
+    CHECK(memcmp(buf, bytes, size) == 0);
+    CHECK(tlv_flat_dumps(flat, buf, size - 1) == 0);
+
+    // a leaf grown after layout, lengths are stale until the next one
+    for (i = 0; i < flat->count && tlv_flat_is_structual(flat, i); i++);
+    memset(grown, 'g', sizeof(grown));
+    CHECK(tlv_flat_write_v(flat, i, grown, sizeof(grown)) == 0);
+    stale = (tlvbyte*)malloc(dumped);
+    CHECK(tlv_flat_dumps(flat, stale, dumped) == 0);
+    free(stale);
+
+    size = tlv_flat_layout(flat);
+    CHECK(tlv_flat_dumps(flat, buf, size) == size);
+    {
+        tlv* l = geometry_of(t);
+        CHECK(tlv_loads(l, buf, size) == size);
+        CHECK(tlv_node_count(l) == 9);
+        tlv_destroy(l);
+    }
+
+    // loading checks every node against its parent
+    CHECK(tlv_flat_loads(flat, bytes, dumped - 1) == 0);
+    CHECK(tlv_flat_loads(flat, bytes, dumped) == dumped);
+
+    free(buf);
+    free(bytes);
+    tlv_flat_destroy(flat);
+    tlv_destroy(t);
+}
+
+/*
+ * files load in every mode, a cut one leaves no tree behind
+ * pointing into a mapping that is gone, dumped files load back
+ */
+static void test_file()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvbyte* bytes;
+    size_t size;
+    char good[32];
+    char cut[32];
+    int mode;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+    CHECK(temp_file(good, bytes, size) == size);
+    CHECK(temp_file(cut, bytes, size - 3) == size - 3);
+
+    for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_LAZY; mode++)
+    {
+        tlv* l = geometry_of(t);
+
+        l->loadmode = mode;
+        CHECK(tlv_load_file(l, good) == size);
+        CHECK(dumps_as(l, bytes, size));
+        tlv_destroy(l);
+
+        l = geometry_of(t);
+        l->loadmode = mode;
+        CHECK(tlv_load_file(l, cut) == 0);
+        if (mode != TLV_LOAD_COPY)
+        {
+            CHECK(l->root == NULL);
+        }
+        tlv_destroy(l);
+    }
+
+    CHECK(tlv_dump_file(t, good) == size);
+    {
+        tlv* l = geometry_of(t);
+        CHECK(tlv_load_file(l, good) == size);
+        CHECK(dumps_as(l, bytes, size));
+        tlv_destroy(l);
+    }
+
+    unlink(good);
+    unlink(cut);
+    free(bytes);
+    tlv_destroy(t);
+}
+
+/*
+ * lazy trees check a level as it is decoded, a bad one fails
+ * whatever reaches it first
+ */
+static void test_lazy()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlv* l = geometry_of(t);
+    tlvbyte* bytes;
+    tlvnode* node;
+    size_t size;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+
+    // first child overruns the root
+    bytes[5 + 3] = 0xff;
+    bytes[5 + 4] = 0xff;
+
+    // only the root is checked up front
+    l->loadmode = TLV_LOAD_LAZY;
+    CHECK(tlv_loads(l, bytes, size - 1) == 0);
+    CHECK(l->root == NULL);
+    CHECK(tlv_loads(l, bytes, size) == size);
+    CHECK(l->root->firstChild == NULL);
+
+    node = leaf(l, 9, "new", 3);
+    CHECK(tlv_node_add_child(l, l->root, node) == -1);
+    CHECK(node->parent == NULL);
+
+    tlv_node_destroy(l, node);
+    tlv_destroy(l);
+    free(bytes);
+    tlv_destroy(t);
+}
+
+/*
+ * every cut of a message, and l claiming more than there is,
+ * is refused by validate and by loads in every mode
+ */
+static void test_rejection()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvbyte* bytes;
+    tlvbyte* bad;
+    size_t size;
+    size_t cut;
+    int mode;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+    bad = (tlvbyte*)malloc(size + 1);
+
+    CHECK(tlv_validate(bytes, size, t, NULL) == size);
+
+    for (cut = 0; cut < size; cut++)
+    {
+        memcpy(bad, bytes, cut);
+        CHECK(tlv_validate(bad, cut, t, NULL) == 0);
+
+        for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_LAZY; mode++)
+        {
+            tlv* l = geometry_of(t);
+
+            l->loadmode = mode;
+            CHECK(tlv_loads(l, bad, cut) == 0);
+            tlv_destroy(l);
+        }
+    }
+
+    // trailing bytes after root
+    memcpy(bad, bytes, size);
+    bad[size] = 0;
+    CHECK(tlv_validate(bad, size + 1, t, NULL) == 0);
+
+    // root l one past the end, then a child l past its parent
+    bad[3] = (tlvbyte)((size - 5 + 1) >> 8);
+    bad[4] = (tlvbyte)(size - 5 + 1);
+    CHECK(tlv_validate(bad, size, t, NULL) == 0);
+    for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_LAZY; mode++)
+    {
+        tlv* l = geometry_of(t);
+
+        l->loadmode = mode;
+        CHECK(tlv_loads(l, bad, size) == 0);
+        tlv_destroy(l);
+    }
+
+    memcpy(bad, bytes, size);
+    bad[5 + 3] = 0xff;
+    bad[5 + 4] = 0xff;
+    CHECK(tlv_validate(bad, size, t, NULL) == 0);
+    for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_VIEW; mode++)
+    {
+        tlv* l = geometry_of(t);
+
+        l->loadmode = mode;
+        CHECK(tlv_loads(l, bad, size) == 0);
+        tlv_destroy(l);
+    }
+
+    // a partial varint message
+    {
+        tlv* packed = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_T | TLV_VARINT_L);
+        tlvbyte* packedbytes;
+        size_t packedsize;
+
+        make_sample(packed);
+        packedbytes = dump(packed, &packedsize);
+        for (cut = 0; cut < packedsize; cut++)
+        {
+            tlv* l = geometry_of(packed);
+            CHECK(tlv_loads(l, packedbytes, cut) == 0);
+            tlv_destroy(l);
+        }
+
+        free(packedbytes);
+        tlv_destroy(packed);
+    }
+
+    free(bad);
+    free(bytes);
+    tlv_destroy(t);
+}
+
+/*
+ * streams of messages stop at a malformed one, and say so,
+ * or at a partial one, which more bytes will complete
+ */
+static void test_streams()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlv_batch* batch = tlv_batch_obtain(t, 0);
+    tlv_pool* pool = tlv_pool_obtain(2);
+    tlvbyte* bytes;
+    tlvbyte* stream;
+    tlv* trees[4];
+    size_t size;
+    size_t count;
+    size_t i;
+    int malformed;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+    stream = (tlvbyte*)malloc(size * 3);
+    for (i = 0; i < 3; i++)
+    {
+        memcpy(stream + i * size, bytes, size);
+    }
+
+    CHECK(tlv_batch_loads(batch, stream, size * 3, &malformed) == size * 3);
+    CHECK(tlv_batch_count(batch) == 3 && !malformed);
+    CHECK(dumps_as(tlv_batch_tree(batch, 2), bytes, size));
+
+    CHECK(tlv_batch_loads(batch, stream, size * 2 + 7, &malformed) == size * 2);
+    CHECK(tlv_batch_count(batch) == 2 && !malformed);
+
+    CHECK(tlv_parallel_loads(pool, t, stream, size * 2 + 7, trees, 4, &count, &malformed) == size * 2);
+    CHECK(count == 2 && !malformed);
+    for (i = 0; i < count; i++)
+    {
+        tlv_destroy(trees[i]);
+    }
+
+    // first child of the second message overruns its parent
+    stream[size + 5 + 3] = 0xff;
+    stream[size + 5 + 4] = 0xff;
+
+    CHECK(tlv_batch_loads(batch, stream, size * 3, &malformed) == size);
+    CHECK(tlv_batch_count(batch) == 1 && malformed);
+
+    CHECK(tlv_parallel_loads(pool, t, stream, size * 3, trees, 4, &count, &malformed) == size);
+    CHECK(count == 1 && malformed);
+    for (i = 0; i < count; i++)
+    {
+        tlv_destroy(trees[i]);
+    }
+
+    free(stream);
+    free(bytes);
+    tlv_pool_destroy(pool);
+    tlv_batch_destroy(batch);
+    tlv_destroy(t);
+}
+
+/*
+ * patched templates load back with the patched values
+ */
+static void test_template()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvnode* slots[2];
+    tlv_template* tpl;
+
+    tlv_set_root(t, structual(t, 1));
+    slots[0] = leaf(t, 2, "abc", 3);
+    slots[1] = leaf(t, 3, "defgh", 5);
+    tlv_node_add_child(t, t->root, slots[0]);
+    tlv_node_add_child(t, t->root, structual(t, 4));
+    tlv_node_add_child(t, child(t, t->root, 4), slots[1]);
+
+    tpl = tlv_template_obtain(t, slots, 2);
+    CHECK(tpl != NULL);
+    if (tpl)
+    {
+        size_t size;
+        const tlvbyte* bytes;
+        tlv* l = geometry_of(t);
+        tlvnode* node;
+
+        CHECK(tlv_template_set(tpl, 0, (const tlvbyte*)"longer value", 12) == 0);
+        CHECK(tlv_template_set(tpl, 1, (const tlvbyte*)"DEFGH", 5) == 0);
+        bytes = tlv_template_bytes(tpl, &size);
+
+        CHECK(tlv_validate(bytes, size, t, NULL) == size);
+        CHECK(tlv_loads(l, (tlvbyte*)bytes, size) == size);
+        node = child(l, l->root, 2);
+        CHECK(node && node->length == 12 && memcmp(node->v, "longer value", 12) == 0);
+        node = child(l, child(l, l->root, 4), 3);
+        CHECK(node && node->length == 5 && memcmp(node->v, "DEFGH", 5) == 0);
+
+        tlv_destroy(l);
+        tlv_template_destroy(tpl);
+    }
+
+    tlv_destroy(t);
+}
+
+typedef struct aio_result
+{
+    const tlvbyte* bytes;
+    size_t size;
+    int done;
+    int failed;
+} aio_result;
+
+static void aio_dumped(const char* path, int error, void* arg)
+{
+    aio_result* r = (aio_result*)arg;
+
+    r->done++;
+    if (error)
+    {
+        r->failed++;
+    }
+}
+
+static void aio_loaded(tlv* tree, const char* path, int error, void* arg)
+{
+    aio_result* r = (aio_result*)arg;
+
+    r->done++;
+    if (error || !tree || !dumps_as(tree, r->bytes, r->size))
+    {
+        r->failed++;
+    }
+
+    tlv_destroy(tree);
+}
+
+/*
+ * files dumped and loaded through every backend there is,
+ * destroy runs the callbacks of what is still pending
+ */
+static void test_aio()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvbyte* bytes;
+    size_t size;
+    char paths[3][32];
+    int backend;
+    int i;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+    for (i = 0; i < 3; i++)
+    {
+        temp_file(paths[i], NULL, 0);
+    }
+
+    for (backend = TLV_AIO_AUTO; backend <= TLV_AIO_THREADS; backend++)
+    {
+        tlv_aio* aio = tlv_aio_obtain(2, (tlv_aio_backend_t)backend);
+        aio_result r = { bytes, size, 0, 0 };
+
+        if (!aio)
+        {
+            // no io_uring in this kernel
+            CHECK(backend == TLV_AIO_URING);
+            continue;
+        }
+
+        for (i = 0; i < 3; i++)
+        {
+            CHECK(tlv_aio_dump(aio, paths[i], bytes, size, aio_dumped, &r) == 0);
+        }
+
+        while (tlv_aio_pending(aio) > 0 && tlv_aio_poll(aio, 1) >= 0);
+        CHECK(r.done == 3 && !r.failed);
+
+        for (i = 0; i < 3; i++)
+        {
+            CHECK(tlv_aio_load(aio, t, paths[i], aio_loaded, &r) == 0);
+        }
+
+        tlv_aio_destroy(aio);
+        CHECK(r.done == 6 && !r.failed);
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+        unlink(paths[i]);
+    }
+
+    free(bytes);
+    tlv_destroy(t);
+}
+
+/*
+ * records appended to a log read back by index, by load and by tag
+ */
+static void test_log()
+{
+    tlv* def = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlv* packed = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_L);
+    tlvbyte* records[10];
+    size_t sizes[10];
+    tlv_log_writer* w;
+    tlv_log* log;
+    char path[32];
+    tlvbyte tag[2];
+    size_t i;
+
+    temp_file(path, NULL, 0);
+
+    w = tlv_log_writer_obtain(def, path, 4);
+    CHECK(w != NULL);
+    if (!w)
+    {
+        unlink(path);
+        tlv_destroy(def);
+        tlv_destroy(packed);
+        return;
+    }
+
+    for (i = 0; i < 10; i++)
+    {
+        tlv* t = geometry_of(def);
+
+        tlv_set_root(t, leaf(t, 100 + i, "record", 1 + i % 6));
+        records[i] = dump(t, &sizes[i]);
+
+        if (i % 2)
+        {
+            CHECK(tlv_log_append_bytes(w, records[i], sizes[i]) == i);
+        }
+        else
+        {
+            CHECK(tlv_log_append(w, t) == i);
+        }
+
+        tlv_destroy(t);
+    }
+
+    tlv_set_root(packed, leaf(packed, 1, "varint", 6));
+    CHECK(tlv_log_append(w, packed) == TLV_FLAT_NONE);
+    CHECK(tlv_log_append_bytes(w, records[0], sizes[0] - 1) == TLV_FLAT_NONE);
+    CHECK(tlv_log_writer_count(w) == 10);
+    CHECK(tlv_log_writer_destroy(w) == 0);
+
+    log = tlv_log_obtain(def, path);
+    CHECK(log != NULL);
+    if (log)
+    {
+        CHECK(tlv_log_count(log) == 10);
+
+        for (i = 0; i < 10; i++)
+        {
+            size_t size;
+            const tlvbyte* record = tlv_log_record(log, i, &size);
+            tlv* l = geometry_of(def);
+
+            CHECK(record && size == sizes[i] && memcmp(record, records[i], size) == 0);
+            CHECK(tlv_log_load(log, i, l) == sizes[i]);
+            CHECK(dumps_as(l, records[i], sizes[i]));
+            tlv_destroy(l);
+
+            tag_of(def, 100 + i, tag);
+            CHECK(tlv_log_find(log, 0, tag, 2) == i);
+        }
+
+        CHECK(tlv_log_record(log, 10, NULL) == NULL);
+        tag_of(def, 99, tag);
+        CHECK(tlv_log_find(log, 0, tag, 2) == TLV_FLAT_NONE);
+
+        tlv_log_destroy(log);
+    }
+
+    unlink(path);
+
+    // a write that fails makes the append at hand fail, and every one after
+    w = tlv_log_writer_obtain(def, "/dev/full", 0);
+    if (w)
+    {
+        size_t appended = 0;
+
+        while (appended < 100000 && tlv_log_append_bytes(w, records[0], sizes[0]) == appended)
+        {
+            appended++;
+        }
+
+        CHECK(appended < 100000);
+        CHECK(tlv_log_append_bytes(w, records[0], sizes[0]) == TLV_FLAT_NONE);
+        CHECK(tlv_log_writer_destroy(w) == -1);
+    }
+
+    for (i = 0; i < 10; i++)
+    {
+        free(records[i]);
+    }
+
+    tlv_destroy(def);
+    tlv_destroy(packed);
+}
+
+/*
+ * compressed leaves survive dump and load, and read back as written
+ */
+static void test_compression()
+{
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvbyte big[TEST_BIG_VALUE];
+    tlvbyte out[TEST_BIG_VALUE];
+    tlvbyte* bytes;
+    size_t size;
+    int mode;
+
+    big_value(big);
+    t->compress = 1;
+    t->compressmin = 64;
+    make_sample(t);
+
+    CHECK(tlv_node_get_attributes(t, child(t, t->root, 5), TLV_NODE_ATTR_IS_COMPRESSED));
+    CHECK(child(t, t->root, 5)->length < TEST_BIG_VALUE);
+    CHECK(tlv_node_value_length(t, child(t, t->root, 5)) == TEST_BIG_VALUE);
+    CHECK(!tlv_node_get_attributes(t, child(t, t->root, 0x1234), TLV_NODE_ATTR_IS_COMPRESSED));
+
+    bytes = dump(t, &size);
+
+    for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_LAZY; mode++)
+    {
+        tlv* l = geometry_of(t);
+        tlvnode* node;
+
+        l->loadmode = mode;
+        CHECK(tlv_loads(l, bytes, size) == size);
+        node = child(l, l->root, 5);
+        CHECK(tlv_node_read_v(l, node, out, sizeof(out)) == TEST_BIG_VALUE);
+        CHECK(memcmp(out, big, TEST_BIG_VALUE) == 0);
+        CHECK(tlv_node_read_v(l, node, out, TEST_BIG_VALUE - 1) == (size_t)-1);
+        CHECK(dumps_as(l, bytes, size));
+
+        CHECK(tlv_node_decompress(l, node) == 0);
+        CHECK(!tlv_node_get_attributes(l, node, TLV_NODE_ATTR_IS_COMPRESSED));
+        CHECK(node->length == TEST_BIG_VALUE && memcmp(node->v, big, TEST_BIG_VALUE) == 0);
+
+        tlv_destroy(l);
+    }
+
+    // an original length no block of this size decodes to
+    {
+        tlv* l = geometry_of(t);
+        tlvbyte* bad = (tlvbyte*)malloc(size);
+        tlvnode* node;
+
+        memcpy(bad, bytes, size);
+        l->loadmode = TLV_LOAD_VIEW;
+        CHECK(tlv_loads(l, bad, size) == size);
+        node = child(l, l->root, 5);
+        memset(node->v, 0xff, 4);
+        CHECK(tlv_node_value_length(l, node) == (size_t)-1);
+        CHECK(tlv_node_read_v(l, node, out, sizeof(out)) == (size_t)-1);
+        CHECK(tlv_node_decompress(l, node) == -1);
+
+        tlv_destroy(l);
+        free(bad);
+    }
+
+    // a value that fills the whole match table
+    {
+        tlv* l = geometry(1, 2, 4, TLV_BYTE_MSB, TLV_VARINT_NONE);
+        size_t n = 70000;
+        tlvbyte* v = (tlvbyte*)malloc(n);
+        tlvbyte* back = (tlvbyte*)malloc(n);
+        tlvnode* node;
+        size_t i;
+
+        for (i = 0; i < n; i++)
+        {
+            v[i] = (tlvbyte)(i % 1000 * 7 + i / 5000);
+        }
+
+        l->compress = 1;
+        l->compressmin = 64;
+        node = leaf(l, 9, v, n);
+        CHECK(node->length < n);
+        CHECK(tlv_node_read_v(l, node, back, n) == n);
+        CHECK(memcmp(back, v, n) == 0);
+
+        tlv_node_destroy(l, node);
+        tlv_destroy(l);
+        free(back);
+        free(v);
+    }
+
+    // with compress off the bit is the user's, values are as written
+    {
+        tlv* plain = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+        tlvnode* node = leaf(plain, 5, big, sizeof(big));
+
+        tlv_node_set_attributes(plain, node, TLV_NODE_ATTR_IS_COMPRESSED, 1);
+        plain->compressmin = 64;
+        tlv_node_write_v(plain, node, big, sizeof(big));
+        CHECK(tlv_node_get_attributes(plain, node, TLV_NODE_ATTR_IS_COMPRESSED));
+        CHECK(node->length == TEST_BIG_VALUE);
+        CHECK(tlv_node_value_length(plain, node) == TEST_BIG_VALUE);
+        CHECK(tlv_node_read_v(plain, node, out, sizeof(out)) == TEST_BIG_VALUE);
+        CHECK(memcmp(out, big, TEST_BIG_VALUE) == 0);
+
+        tlv_node_destroy(plain, node);
+        tlv_destroy(plain);
+    }
+
+    free(bytes);
+    tlv_destroy(t);
+}
+
+/*
+ * varint trees come out smaller, and read back the same
+ */
+static void test_varint()
+{
+    tlv* plain = geometry(1, 4, 4, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlv* packed = geometry(1, 4, 4, TLV_BYTE_MSB, TLV_VARINT_T | TLV_VARINT_L);
+    tlvbyte* plainbytes;
+    tlvbyte* packedbytes;
+    size_t plainsize;
+    size_t packedsize;
+    tlv* l;
+    tlvbyte tag[4];
+    tlvbyte expected[4];
+
+    make_sample(plain);
+    make_sample(packed);
+    plainbytes = dump(plain, &plainsize);
+    packedbytes = dump(packed, &packedsize);
+    CHECK(packedsize < plainsize);
+
+    l = geometry_of(packed);
+    CHECK(tlv_loads(l, packedbytes, packedsize) == packedsize);
+    CHECK(tlv_node_read_t(l, child(l, l->root, 0x1234), tag, sizeof(tag)) == 4);
+    tag_of(l, 0x1234, expected);
+    CHECK(memcmp(tag, expected, 4) == 0);
+    tlv_destroy(l);
+
+    // functions working on encoded bytes refuse varint
+    CHECK(tlv_validate(packedbytes, packedsize, packed, NULL) == 0);
+    CHECK(tlv_batch_obtain(packed, 0) == NULL);
+
+    free(plainbytes);
+    free(packedbytes);
+    tlv_destroy(plain);
+    tlv_destroy(packed);
+}
+
+/*
+ * tag of the node the cursor is at, low byte
+ */
+static int cursor_tag(const tlv_cursor* c)
+{
+    return c->node->t[c->tlv->tlength - 1];
+}
+
+/*
+ * cursor walks the sample in both orders, with depth and skips
+ */
+static void test_cursor()
+{
+    static const int pre[] = { 1, 2, 3, 4, 5, 6, 7, 8, 0x34 };
+    static const size_t predepth[] = { 0, 1, 2, 2, 1, 1, 2, 3, 1 };
+    static const int post[] = { 3, 4, 2, 5, 8, 7, 6, 0x34, 1 };
+    static const size_t postdepth[] = { 2, 2, 1, 1, 3, 2, 1, 1, 0 };
+    static const int skipped[] = { 1, 2, 5, 6, 0x34 };
+    tlv* t = geometry(1, 2, 2, TLV_BYTE_MSB, TLV_VARINT_NONE);
+    tlvbyte* bytes;
+    tlv_cursor c;
+    size_t size;
+    size_t i;
+    int mode;
+
+    make_sample(t);
+    bytes = dump(t, &size);
+
+    for (mode = TLV_LOAD_COPY; mode <= TLV_LOAD_LAZY; mode++)
+    {
+        tlv* l = geometry_of(t);
+
+        l->loadmode = mode;
+        CHECK(tlv_loads(l, bytes, size) == size);
+
+        i = 0;
+        for (tlv_cursor_init(&c, l, l->root, TLV_CURSOR_PREORDER); c.node; tlv_cursor_next(&c), i++)
+        {
+            CHECK(i < 9 && cursor_tag(&c) == pre[i] && c.depth == predepth[i]);
+        }
+        CHECK(i == 9);
+
+        i = 0;
+        for (tlv_cursor_init(&c, l, l->root, TLV_CURSOR_POSTORDER); c.node; tlv_cursor_next(&c), i++)
+        {
+            CHECK(i < 9 && cursor_tag(&c) == post[i] && c.depth == postdepth[i]);
+        }
+        CHECK(i == 9);
+
+        i = 0;
+        for (tlv_cursor_init(&c, l, l->root, TLV_CURSOR_PREORDER); c.node; tlv_cursor_next(&c), i++)
+        {
+            CHECK(i < 5 && cursor_tag(&c) == skipped[i]);
+            if (cursor_tag(&c) == 2 || cursor_tag(&c) == 6)
+            {
+                tlv_cursor_skip(&c);
+            }
+        }
+        CHECK(i == 5);
+
+        // a subtree is walked without leaving it
+        i = 0;
+        for (tlv_cursor_init(&c, l, child(l, l->root, 6), TLV_CURSOR_POSTORDER); c.node; tlv_cursor_next(&c))
+        {
+            i++;
+        }
+        CHECK(i == 3);
+
+        tlv_destroy(l);
+    }
+
+    // shallow cursors leave lazy nodes as they are
+    {
+        tlv* l = geometry_of(t);
+
+        l->loadmode = TLV_LOAD_LAZY;
+        CHECK(tlv_loads(l, bytes, size) == size);
+
+        i = 0;
+        for (tlv_cursor_init(&c, l, l->root, TLV_CURSOR_PREORDER | TLV_CURSOR_SHALLOW); c.node; tlv_cursor_next(&c))
+        {
+            i++;
+        }
+        CHECK(i == 1);
+        CHECK(tlv_node_count(l) == 9);
+        CHECK(l->root->firstChild == NULL);
+
+        tlv_destroy(l);
+    }
+
+    tlv_cursor_init(&c, t, NULL, TLV_CURSOR_POSTORDER);
+    CHECK(c.node == NULL && tlv_cursor_next(&c) == NULL);
+
+    free(bytes);
+    tlv_destroy(t);
+}
+
+int main()
+{
+    test_roundtrip();
+    test_decoder();
+    test_index();
+    test_flat();
+    test_file();
+    test_lazy();
+    test_rejection();
+    test_streams();
+    test_template();
+    test_aio();
+    test_log();
+    test_compression();
+    test_varint();
+    test_cursor();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+    return 0;
+}
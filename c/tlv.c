@@ -33,6 +33,25 @@
 #include<malloc.h>
 #include<stddef.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+// io_uring is driven by raw system calls, no liburing needed
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define AIO_HAVE_URING 1
+#endif
+#endif
+#endif
 
 #include"tlv.h"
 
@@ -40,6 +59,79 @@
 #define STACK_INCREASE (10)
 #define STACK_INIT_SIZE (10)
 
+#define ARENA_DEF_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN (sizeof(void*))
+
+// tlvnode::flags bits
+#define NODE_FLAG_ARENA (0x01) // node block and its buffers live in tlv->arena
+#define NODE_FLAG_VIEW_HDR (0x02) // a, t, l point into loaded bytes
+#define NODE_FLAG_VIEW_V (0x04) // v points into loaded bytes
+#define NODE_FLAG_OWN_HDR (0x08) // a, t, l were copied out into a block of their own
+#define NODE_FLAG_DIRTY (0x10) // length changed since l was last written
+#define NODE_FLAG_LAZY (TLV_NODE_FLAG_LAZY) // children not materialized yet, v points to their bytes
+#define NODE_FLAG_INDEXED (0x40) // node is in tlv->index
+
+#define INDEX_INIT_BUCKETS (64)
+
+#define VALIDATE_DEPTH (64) // nesting tlv_validate tracks without allocation
+
+#define DUMPV_COPY_MAX (64) // values up to this are copied next to their header by tlv_dumpv
+
+#define PARALLEL_MIN_GRAIN (16 * 1024) // bytes, smaller subtrees are not worth a task
+#define PARALLEL_TASKS_PER_WORKER (8)
+
+#define AIO_DEF_DEPTH (64)
+#define AIO_THREADS (4) // threads of the fallback backend, at most
+#define AIO_IOV_MAX (1024) // iov entries per read or write call
+
+#define LZ_HASH_BITS (12)
+#define LZ_MIN_MATCH (4)
+#define LZ_LAST_LITERALS (5) // an LZ4 block ends with this many literals at least
+#define LZ_MFLIMIT (12) // no match starts this close to the end
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HDR_SIZE (4) // original length ahead of a compressed value
+#define LZ_MAX_RATIO (255) // an LZ4 block decodes to at most this many times its size
+
+#define LOG_MAGIC "TLVLOGIX"
+#define LOG_TRAILER_SIZE (5 * 8) // magic, count, records per block, tlength, footer offset
+#define LOG_BUF_SIZE (64 * 1024) // records buffered by a log writer
+
+#ifdef TLV_ENABLE_STATS
+// counters are bumped atomically, pool workers share one tlv
+#define STATS_ADD(t, field, n) __atomic_add_fetch(&(t)->stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_MAX(t, field, n) stats_max(&(t)->stats.field, (n))
+#define STATS_TIME_BEGIN(start) unsigned long long start = stats_now()
+#define STATS_TIME_END(t, field, start) STATS_ADD(t, field, stats_now() - (start))
+
+static unsigned long long stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_max(size_t* field, size_t n)
+{
+    size_t cur = __atomic_load_n(field, __ATOMIC_RELAXED);
+
+    while (n > cur
+           && !__atomic_compare_exchange_n(field, &cur, n, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+#else
+#define STATS_ADD(t, field, n) ((void)0)
+#define STATS_MAX(t, field, n) ((void)0)
+#define STATS_TIME_BEGIN(start)
+#define STATS_TIME_END(t, field, start) ((void)0)
+#endif
+
+
+static void index_reset(tlv* t);
+static void index_destroy(struct tlv_index* index);
+static void index_subtree(tlv* t, tlvnode* top, int add);
+
 
 typedef struct
 {
@@ -70,8 +162,8 @@ static int realloc_stack(_stack* s)
         return -1;
     }
 
-    int newsize = sizeof(void**) * (s->size + STACK_INCREASE);
-    s->data = (void**) realloc(s->data, newsize);
+    int newsize = s->size + STACK_INCREASE;
+    s->data = (void**) realloc(s->data, sizeof(void*) * newsize);
     s->size = newsize;
 
     if (!s->data)
@@ -132,133 +224,362 @@ static void stack_destroy(_stack* s)
     free(s);
 }
 
+static size_t loads_tree(tlv* tlv, tlvbyte* bytes, size_t size, _stack* lstack);
+static size_t loads_nodes(tlv* tlv, tlvbyte* bytes, size_t size, _stack* lstack, tlvnode** top);
 
 
-tlv* tlv_obtain()
+
+typedef struct tlv_arena_chunk
 {
-    tlv* newtlv = (tlv*)malloc(sizeof(tlv));
-    newtlv->alength = TLV_DEF_A_LENGTH;
-    newtlv->tlength = TLV_DEF_T_LENGTH;
-    newtlv->llength = TLV_DEF_L_LENGTH;
-    newtlv->root = NULL;
-    newtlv->byteprio = TLV_BYTE_MSB;
-    newtlv->dumplength = 0;
+    struct tlv_arena_chunk* next;
+    size_t size;
+    size_t used;
+} tlv_arena_chunk;
 
-    return newtlv;
+struct tlv_arena
+{
+    tlv_arena_chunk* head;
+    tlv_arena_chunk* spare; // chunks of chunksize kept by arena_reset
+    size_t chunksize;
+};
+
+static size_t arena_chunk_header_size()
+{
+    return (sizeof(tlv_arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
 }
 
-void tlv_set_root(tlv* t, tlvnode* root)
+static struct tlv_arena* arena_obtain(size_t chunksize)
 {
-    if (t)
+    struct tlv_arena* arena = (struct tlv_arena*)malloc(sizeof(struct tlv_arena));
+    if (!arena)
     {
-        t->root = root;
+        return NULL;
     }
+
+    arena->head = NULL;
+    arena->spare = NULL;
+    arena->chunksize = chunksize > 0 ? chunksize : ARENA_DEF_CHUNK_SIZE;
+
+    return arena;
 }
 
-int tlv_node_count(const tlv* tlv)
+static tlv_arena_chunk* arena_chunk_obtain(size_t size)
 {
-    int node_count = 0;
-    _stack* coStack;
-    tlvnode* curnode;
+    tlv_arena_chunk* chunk = (tlv_arena_chunk*)malloc(arena_chunk_header_size() + size);
+    if (!chunk)
+    {
+        return NULL;
+    }
 
-    if (!tlv)
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+static void* arena_alloc(struct tlv_arena* arena, size_t size)
+{
+    tlv_arena_chunk* chunk;
+    void* p;
+
+    if (!arena)
     {
-        return 0;
+        return NULL;
     }
 
-    curnode = tlv->root;
-    coStack = stack_obtain(STACK_INIT_SIZE);
-    stack_push(coStack, curnode);
-    node_count++;
-    while (coStack->index > 0)
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size)
     {
-        tlvnode* child;
-        curnode = (tlvnode*) stack_pop(coStack);
-        child = curnode->firstChild;
-        while (child)
+        if (size > arena->chunksize / 2)
+        {
+            // big block gets a chunk of its own, the current
+            // head keeps serving small ones
+            chunk = arena_chunk_obtain(size);
+            if (!chunk)
+            {
+                return NULL;
+            }
+
+            if (arena->head)
+            {
+                chunk->next = arena->head->next;
+                arena->head->next = chunk;
+            }
+            else
+            {
+                arena->head = chunk;
+            }
+        }
+        else
         {
-            stack_push(coStack, child);
-            node_count++;
-            child = child->nextSubling;
+            chunk = arena->spare;
+            if (chunk)
+            {
+                arena->spare = chunk->next;
+                chunk->used = 0;
+            }
+            else
+            {
+                chunk = arena_chunk_obtain(arena->chunksize);
+                if (!chunk)
+                {
+                    return NULL;
+                }
+            }
+
+            chunk->next = arena->head;
+            arena->head = chunk;
         }
     }
-    return node_count;
+
+    p = (tlvbyte*)chunk + arena_chunk_header_size() + chunk->used;
+    chunk->used += size;
+
+    return p;
 }
 
-tlvnode* tlv_node_obtain(tlv* tlv)
+static void arena_free_chunks(tlv_arena_chunk* chunk)
 {
-    if (!tlv)
+    while (chunk)
     {
-        return NULL;
+        tlv_arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+}
 
-    tlvnode* newnode = (tlvnode*) malloc(sizeof(tlvnode));
-    newnode->t = (tlvbyte*) malloc(tlv->tlength);
-    memset(newnode->t, 0x00, tlv->tlength);
+/*
+ * drop everything allocated from arena at once, chunks of the
+ * regular size are kept to serve allocations after it
+ */
+static void arena_reset(struct tlv_arena* arena)
+{
+    tlv_arena_chunk* chunk = arena->head;
 
-    newnode->l = (tlvbyte*)malloc(tlv->llength);
-    memset(newnode->l, 0x00, tlv->llength);
+    while (chunk)
+    {
+        tlv_arena_chunk* next = chunk->next;
 
-    newnode->a = (tlvbyte*)malloc(tlv->alength);
-    memset(newnode->a, 0x00, tlv->alength);
+        if (chunk->size == arena->chunksize)
+        {
+            chunk->next = arena->spare;
+            arena->spare = chunk;
+        }
+        else
+        {
+            free(chunk);
+        }
 
-    newnode->length = 0;
-    newnode->tlv = tlv;
-    newnode->v = NULL;
-    newnode->parent = NULL;
-    newnode->childCount = 0;
-    newnode->firstChild = newnode->nextSubling = newnode->prevSubling = NULL;
+        chunk = next;
+    }
 
-    return newnode;
+    arena->head = NULL;
 }
 
-void tlv_destroy(tlv* t)
+/*
+ * move every chunk of src into dst, src is left empty
+ */
+static void arena_adopt(struct tlv_arena* dst, struct tlv_arena* src)
 {
-    if (!t)
+    tlv_arena_chunk* tail;
+
+    if (src->head)
     {
-        return;
+        // behind dst head, which keeps serving small blocks
+        for (tail = src->head; tail->next; tail = tail->next);
+
+        if (dst->head)
+        {
+            tail->next = dst->head->next;
+            dst->head->next = src->head;
+        }
+        else
+        {
+            dst->head = src->head;
+        }
     }
 
-    if (t->root)
+    if (src->spare)
     {
-        tlv_node_destroy(t, t->root);
+        for (tail = src->spare; tail->next; tail = tail->next);
+
+        tail->next = dst->spare;
+        dst->spare = src->spare;
     }
 
-    free(t);
+    src->head = src->spare = NULL;
+}
+
+static void arena_destroy(struct tlv_arena* arena)
+{
+    if (!arena)
+    {
+        return;
+    }
+
+    arena_free_chunks(arena->head);
+    arena_free_chunks(arena->spare);
+
+    free(arena);
 }
 
 /*
- * get length from *l
+ * arena of the pool worker decoding into a tlv shared with other
+ * workers, so they do not race on tlv->arena, see tlv_parallel_loads_tree
  */
-static size_t tlv_node_get_length(tlv* t, tlvnode* node)
+static __thread struct tlv_arena* worker_arena;
+
+/*
+ * allocate memory for nodes of tlv, from arena if any
+ */
+static void* tlv_alloc(tlv* t, size_t size)
 {
-    size_t i;
-    size_t length = 0;
+    STATS_ADD(t, allocs, 1);
+    STATS_ADD(t, allocbytes, size);
 
-    if (!t || !node)
+    if (t->arena)
     {
-        return -1;
+        return arena_alloc(worker_arena ? worker_arena : t->arena, size);
+    }
+
+    return malloc(size);
+}
+
+/*
+ * release memory obtained by tlv_alloc for node,
+ * arena memory goes away together with the arena
+ */
+static void tlv_free(const tlvnode* node, void* p)
+{
+    if (node->flags & NODE_FLAG_ARENA)
+    {
+        return;
     }
 
+    free(p);
+}
+
+
+/*
+ * codec: kernels for the header of one tlv geometry.
+ * the specialized ones below are stamped out by macros for common
+ * geometries, so the compiler sees fixed field sizes and turns length
+ * codec into a single load and byte swap. any other geometry goes
+ * through the generic kernels, which loop over tlv fields.
+ */
+typedef struct tlv_codec
+{
+    size_t alength;
+    size_t tlength;
+    size_t llength;
+    tlv_byte_prio_order_t byteprio;
+
+    size_t (*get_length)(const tlv* t, const tlvbyte* l);
+    void (*put_length)(const tlv* t, tlvbyte* l, size_t length);
+
+    // copy a, t, l of a header from src to dst, back to back
+    void (*read_header)(const tlv* t, tlvbyte* dst, const tlvbyte* src);
+    // write a, t, l of node to dst, back to back
+    void (*write_header)(const tlv* t, tlvbyte* dst, const tlvnode* node);
+} tlv_codec;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_IS_MSB 1
+#else
+#define HOST_IS_MSB 0
+#endif
+
+static size_t get_l8(const tlv* t, const tlvbyte* l)
+{
+    return l[0];
+}
+
+static void put_l8(const tlv* t, tlvbyte* l, size_t length)
+{
+    l[0] = (tlvbyte)length;
+}
+
+#define LENGTH_KERNELS(bits, prio, swap) \
+static size_t get_l##bits##_##prio(const tlv* t, const tlvbyte* l) \
+{ \
+    uint##bits##_t v; \
+    memcpy(&v, l, sizeof(v)); \
+    return (size_t)((swap) ? __builtin_bswap##bits(v) : v); \
+} \
+\
+static void put_l##bits##_##prio(const tlv* t, tlvbyte* l, size_t length) \
+{ \
+    uint##bits##_t v = (uint##bits##_t)length; \
+    v = (swap) ? __builtin_bswap##bits(v) : v; \
+    memcpy(l, &v, sizeof(v)); \
+}
+
+LENGTH_KERNELS(16, msb, !HOST_IS_MSB)
+LENGTH_KERNELS(16, lsb, HOST_IS_MSB)
+LENGTH_KERNELS(32, msb, !HOST_IS_MSB)
+LENGTH_KERNELS(32, lsb, HOST_IS_MSB)
+
+#define TLV_CODEC(name, A, T, L, prio, lkernel) \
+static void name##_read_header(const tlv* t, tlvbyte* dst, const tlvbyte* src) \
+{ \
+    memcpy(dst, src, (A) + (T) + (L)); \
+} \
+\
+static void name##_write_header(const tlv* t, tlvbyte* dst, const tlvnode* node) \
+{ \
+    memcpy(dst, node->a, (A)); \
+    memcpy(dst + (A), node->t, (T)); \
+    memcpy(dst + (A) + (T), node->l, (L)); \
+} \
+\
+static const tlv_codec name = { \
+    (A), (T), (L), (prio), \
+    get_##lkernel, put_##lkernel, \
+    name##_read_header, name##_write_header \
+};
+
+TLV_CODEC(codec_1_1_1_msb, 1, 1, 1, TLV_BYTE_MSB, l8)
+TLV_CODEC(codec_1_1_1_lsb, 1, 1, 1, TLV_BYTE_LSB, l8)
+TLV_CODEC(codec_1_2_2_msb, 1, 2, 2, TLV_BYTE_MSB, l16_msb)
+TLV_CODEC(codec_1_2_2_lsb, 1, 2, 2, TLV_BYTE_LSB, l16_lsb)
+TLV_CODEC(codec_1_2_4_msb, 1, 2, 4, TLV_BYTE_MSB, l32_msb)
+TLV_CODEC(codec_1_2_4_lsb, 1, 2, 4, TLV_BYTE_LSB, l32_lsb)
+TLV_CODEC(codec_1_4_4_msb, 1, 4, 4, TLV_BYTE_MSB, l32_msb)
+TLV_CODEC(codec_1_4_4_lsb, 1, 4, 4, TLV_BYTE_LSB, l32_lsb)
+TLV_CODEC(codec_1_64_2_msb, 1, 64, 2, TLV_BYTE_MSB, l16_msb) // string tags, as main.c
+
+static const tlv_codec* const codecs[] = {
+    &codec_1_2_2_msb, // default geometry first
+    &codec_1_2_2_lsb,
+    &codec_1_1_1_msb,
+    &codec_1_1_1_lsb,
+    &codec_1_2_4_msb,
+    &codec_1_2_4_lsb,
+    &codec_1_4_4_msb,
+    &codec_1_4_4_lsb,
+    &codec_1_64_2_msb,
+};
+
+static size_t generic_get_length(const tlv* t, const tlvbyte* l)
+{
+    size_t i;
+    size_t length = 0;
 
     if (t->byteprio == TLV_BYTE_MSB)
     {
         for (i = 0; i < t->llength; i++)
         {
-            length = (length + node->l[i] / 16) * 16;
-            length = (length + node->l[i] % 16) * 16;
+            length = (length << 8) | l[i];
         }
     }
     else if (t->byteprio == TLV_BYTE_LSB)
     {
-        for (i = t->llength - 1; i >= 0; i--)
+        for (i = t->llength; i-- > 0; )
         {
-            length = (length + node->l[i] / 16) * 16;
-            length = (length + node->l[i] % 16) * 16;
-            if (i == 0)
-            {
-                break;
-            }
+            length = (length << 8) | l[i];
         }
     }
     else
@@ -266,684 +587,6908 @@ static size_t tlv_node_get_length(tlv* t, tlvnode* node)
         // do nothing
     }
 
-    return length / 16;
+    return length;
 }
 
-/*
- * set *l from length
- */
-static void tlv_node_set_l(tlv* t, tlvnode* node, size_t length)
+static void generic_put_length(const tlv* t, tlvbyte* l, size_t length)
 {
     size_t i;
-    int a;
-    int b1;
-    int b2;
-
-    if (!t || !node)
-    {
-        return;
-    }
 
-    for (i = 0; i < t->llength; i++)
-    {
-        node->l[i] = 0;
-    }
-
-    a = length;
+    memset(l, 0x00, t->llength);
 
     if (t->byteprio == TLV_BYTE_MSB)
     {
-        for (i = t->llength - 1; i >= 0; i--)
+        for (i = t->llength; i-- > 0 && length; )
         {
-            b1 = a % 16;
-            a = a / 16;
-            b2 = a % 16;
-            a = a / 16;
-            node->l[i] = b2 * 16 + b1;
-            if (i == 0)
-            {
-                break;
-            }
+            l[i] = (tlvbyte)length;
+            length >>= 8;
         }
     }
     else if (t->byteprio == TLV_BYTE_LSB)
     {
-        for (i = 0; i < t->llength; i++)
+        for (i = 0; i < t->llength && length; i++)
         {
-            b1 = a % 16;
-            a = a / 16;
-            b2 = a % 16;
-            a = a / 16;
-            node->l[i] = b2 * 16 + b1;
+            l[i] = (tlvbyte)length;
+            length >>= 8;
         }
     }
     else
     {
         // do nothing
     }
+}
+
+static void generic_read_header(const tlv* t, tlvbyte* dst, const tlvbyte* src)
+{
+    memcpy(dst, src, t->alength + t->tlength + t->llength);
+}
+
+static void generic_write_header(const tlv* t, tlvbyte* dst, const tlvnode* node)
+{
+    memcpy(dst, node->a, t->alength);
+    memcpy(dst + t->alength, node->t, t->tlength);
+    memcpy(dst + t->alength + t->tlength, node->l, t->llength);
+}
 
+static const tlv_codec generic_codec = {
+    0, 0, 0, TLV_BYTE_MSB,
+    generic_get_length, generic_put_length,
+    generic_read_header, generic_write_header
+};
+
+static int codec_matches(const tlv_codec* c, const tlv* t)
+{
+    return c->alength == t->alength
+        && c->tlength == t->tlength
+        && c->llength == t->llength
+        && c->byteprio == t->byteprio;
 }
 
 /*
- * load bytes into tlv node tree.
- * defination for tlv should be set into original tlv struct.
- * if succeed, tlv node tree should be set to tlv->root.
- * returns the node count.
+ * find kernels for current geometry of t
  */
-size_t tlv_loads(tlv* tlv, tlvbyte* bytes, size_t size)
+static const tlv_codec* codec_lookup(const tlv* t)
 {
-    int byteshandled = -1;
-    int nodecount = 0;
-    tlvnode* curparent;
+    size_t i;
 
-    if (!tlv || !bytes || size <= 0)
+    if (t->codec && codec_matches(t->codec, t))
     {
-        return 0;
+        return t->codec;
     }
 
-    _stack* lstack = stack_obtain(STACK_INIT_SIZE);
-
-    size_t index = 0;
-    tlv_node_attr_t attr = TLV_NODE_ATTR_IS_STRUCTUAL;
-
-    while (index < size)
+    for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
     {
-        if (byteshandled >= 0)
+        if (codec_matches(codecs[i], t))
         {
-            if (index >= byteshandled)
-            {
-                break;
-            }
+            return codecs[i];
         }
+    }
 
-        size_t i;
-        int hasChild;
+    return &generic_codec;
+}
 
-        tlvnode *node = tlv_node_obtain(tlv);
-        if (index == 0)
-        {
-            tlv->root = node;
-            curparent = tlv->root;
-        }
-        else
-        {
-            tlv_node_add_child(tlv, curparent, node);
-        }
+/*
+ * kernels for t, remembered in t until its geometry changes
+ */
+static const tlv_codec* tlv_codec_of(tlv* t)
+{
+    t->codec = codec_lookup(t);
+    return t->codec;
+}
 
-        nodecount += 1;
+/*
+ * mask of attribute bit within its byte of a
+ */
+static tlvbyte attr_mask(tlv_node_attr_t attr)
+{
+    return 0x01 << (7 - attr % 8);
+}
 
-        for (i = 0; i < tlv->alength; i++)
-        {
-            node->a[i] = bytes[index++];
-        }
+/*
+ * test attribute bit in a bytes
+ */
+static int attr_bit(const tlvbyte* a, tlv_node_attr_t attr)
+{
+    return a[attr / 8] & attr_mask(attr);
+}
 
-        for (i = 0; i < tlv->tlength; i++)
-        {
-            node->t[i] = bytes[index++];
-        }
 
-        for (i = 0; i < tlv->llength; i++)
-        {
-            node->l[i] = bytes[index++];
-        }
+tlv* tlv_obtain()
+{
+    tlv* newtlv = (tlv*)malloc(sizeof(tlv));
+    newtlv->alength = TLV_DEF_A_LENGTH;
+    newtlv->tlength = TLV_DEF_T_LENGTH;
+    newtlv->llength = TLV_DEF_L_LENGTH;
+    newtlv->root = NULL;
+    newtlv->byteprio = TLV_BYTE_MSB;
+    newtlv->varint = TLV_VARINT_NONE;
+    newtlv->dumplength = 0;
+    newtlv->arena = NULL;
+    newtlv->loadmode = TLV_LOAD_COPY;
+    newtlv->compress = 0;
+    newtlv->compressmin = 0;
+    newtlv->codec = NULL;
+    newtlv->mapping = NULL;
+    newtlv->mappingsize = 0;
+    newtlv->index = NULL;
+#ifdef TLV_ENABLE_STATS
+    memset(&newtlv->stats, 0, sizeof(newtlv->stats));
+#endif
 
-        node->length = tlv_node_get_length(tlv, node);
+    return newtlv;
+}
 
-        hasChild = tlv_node_get_attributes(tlv, node, attr);
-        if (hasChild) //have child
-        {
-            int* n = (int*)malloc(sizeof(int));
+int tlv_use_arena(tlv* t, size_t chunksize)
+{
+    if (!t || t->root)
+    {
+        return -1;
+    }
 
-            *n = index + node->length;
-            stack_push(lstack, n);
-            curparent = node;
-        }
+    if (t->arena)
+    {
+        return 0;
+    }
+
+    t->arena = arena_obtain(chunksize);
+
+    return t->arena ? 0 : -1;
+}
+
+int tlv_stats_snapshot(const tlv* t, tlv_stats* stats)
+{
+#ifdef TLV_ENABLE_STATS
+    if (!t || !stats)
+    {
+        return -1;
+    }
+
+    // field by field, workers may be bumping them meanwhile
+    stats->nodescreated = __atomic_load_n(&t->stats.nodescreated, __ATOMIC_RELAXED);
+    stats->nodesdestroyed = __atomic_load_n(&t->stats.nodesdestroyed, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&t->stats.allocs, __ATOMIC_RELAXED);
+    stats->allocbytes = __atomic_load_n(&t->stats.allocbytes, __ATOMIC_RELAXED);
+    stats->loadbytes = __atomic_load_n(&t->stats.loadbytes, __ATOMIC_RELAXED);
+    stats->dumpbytes = __atomic_load_n(&t->stats.dumpbytes, __ATOMIC_RELAXED);
+    stats->layouts = __atomic_load_n(&t->stats.layouts, __ATOMIC_RELAXED);
+    stats->layoutnodes = __atomic_load_n(&t->stats.layoutnodes, __ATOMIC_RELAXED);
+    stats->peakdepth = __atomic_load_n(&t->stats.peakdepth, __ATOMIC_RELAXED);
+    stats->loadsns = __atomic_load_n(&t->stats.loadsns, __ATOMIC_RELAXED);
+    stats->dumpsns = __atomic_load_n(&t->stats.dumpsns, __ATOMIC_RELAXED);
+    stats->layoutns = __atomic_load_n(&t->stats.layoutns, __ATOMIC_RELAXED);
+    stats->traversens = __atomic_load_n(&t->stats.traversens, __ATOMIC_RELAXED);
+    stats->destroyns = __atomic_load_n(&t->stats.destroyns, __ATOMIC_RELAXED);
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void tlv_stats_reset(tlv* t)
+{
+#ifdef TLV_ENABLE_STATS
+    if (t)
+    {
+        memset(&t->stats, 0, sizeof(t->stats));
+    }
+#endif
+}
+
+void tlv_set_root(tlv* t, tlvnode* root)
+{
+    if (t)
+    {
+        t->root = root;
+        index_reset(t);
+    }
+}
+
+/*
+ * count descendants of a lazy node straight from its bytes,
+ * headers come in preorder so it is one linear walk
+ */
+static int lazy_count(const tlv* t, const tlvnode* node)
+{
+    const tlv_codec* codec = codec_lookup(t);
+    size_t hdrsize = t->alength + t->tlength + t->llength;
+    const tlvbyte* p = node->v;
+    const tlvbyte* end = node->v + node->length;
+    int count = 0;
+
+    while ((size_t)(end - p) >= hdrsize)
+    {
+        size_t length = codec->get_length(t, p + t->alength + t->tlength);
+
+        ++count;
+        if (!attr_bit(p, TLV_NODE_ATTR_IS_STRUCTUAL))
+        {
+            p += length;
+        }
+
+        p += hdrsize;
+        if (p > end)
+        {
+            break;
+        }
+    }
+
+    return count;
+}
+
+int tlv_node_count(const tlv* tlv)
+{
+    int node_count = 0;
+    tlv_cursor c;
+
+    if (!tlv)
+    {
+        return 0;
+    }
+
+    // shallow, lazy subtrees are counted from their bytes
+    for (tlv_cursor_init(&c, (struct tlv*)tlv, tlv->root, TLV_CURSOR_PREORDER | TLV_CURSOR_SHALLOW);
+         c.node; tlv_cursor_next(&c))
+    {
+        node_count++;
+        if (c.node->flags & NODE_FLAG_LAZY)
+        {
+            node_count += lazy_count(tlv, c.node);
+        }
+    }
+
+    return node_count;
+}
+
+/*
+ * allocate a blank node, with storage for a, t, l
+ * unless they are going to be borrowed from loaded bytes
+ */
+static tlvnode* node_alloc(tlv* tlv, int withheader)
+{
+    size_t hdrsize = withheader ? tlv->alength + tlv->tlength + tlv->llength : 0;
+
+    // node and its a, t, l fields share one block
+    tlvnode* newnode = (tlvnode*) tlv_alloc(tlv, sizeof(tlvnode) + hdrsize);
+    if (!newnode)
+    {
+        return NULL;
+    }
+
+    if (withheader)
+    {
+        newnode->a = (tlvbyte*)(newnode + 1);
+        newnode->t = newnode->a + tlv->alength;
+        newnode->l = newnode->t + tlv->tlength;
+        memset(newnode->a, 0x00, hdrsize);
+    }
+    else
+    {
+        newnode->a = newnode->t = newnode->l = NULL;
+    }
+
+    newnode->flags = tlv->arena ? NODE_FLAG_ARENA : 0;
+    newnode->length = 0;
+    newnode->tlv = tlv;
+    newnode->v = NULL;
+    newnode->parent = NULL;
+    newnode->childCount = 0;
+    newnode->firstChild = newnode->lastChild = NULL;
+    newnode->nextSubling = newnode->prevSubling = NULL;
+    newnode->dirtyFirst = newnode->dirtyNext = newnode->dirtyPrev = NULL;
+    STATS_ADD(tlv, nodescreated, 1);
+
+    return newnode;
+}
+
+tlvnode* tlv_node_obtain(tlv* tlv)
+{
+    if (!tlv)
+    {
+        return NULL;
+    }
+
+    return node_alloc(tlv, 1);
+}
+
+/*
+ * copy-on-write for a view node: make a, t, l of node
+ * writable, copying them out of the loaded bytes if borrowed
+ * returns: 0 if succeed
+ */
+static int tlv_node_own_header(tlv* t, tlvnode* node)
+{
+    size_t hdrsize;
+    tlvbyte* hdr;
+
+    if (!(node->flags & NODE_FLAG_VIEW_HDR))
+    {
+        return 0;
+    }
+
+    hdrsize = t->alength + t->tlength + t->llength;
+    hdr = (tlvbyte*)tlv_alloc(t, hdrsize);
+    if (!hdr)
+    {
+        return -1;
+    }
+
+    memcpy(hdr, node->a, t->alength);
+    memcpy(hdr + t->alength, node->t, t->tlength);
+    memcpy(hdr + t->alength + t->tlength, node->l, t->llength);
+
+    node->a = hdr;
+    node->t = hdr + t->alength;
+    node->l = node->t + t->tlength;
+    node->flags &= ~NODE_FLAG_VIEW_HDR;
+    node->flags |= NODE_FLAG_OWN_HDR;
+
+    return 0;
+}
+
+/*
+ * release v of node unless it is borrowed
+ */
+static void tlv_node_free_v(tlvnode* node)
+{
+    if (node->v && !(node->flags & NODE_FLAG_VIEW_V))
+    {
+        tlv_free(node, node->v);
+    }
+
+    node->v = NULL;
+    node->flags &= ~(NODE_FLAG_VIEW_V | NODE_FLAG_LAZY);
+}
+
+void tlv_destroy(tlv* t)
+{
+    if (!t)
+    {
+        return;
+    }
+
+    if (t->index)
+    {
+        index_destroy(t->index);
+        t->index = NULL;
+    }
+
+    if (t->arena)
+    {
+        // whole tree lives in the arena
+        arena_destroy(t->arena);
+        t->arena = NULL;
+    }
+    else if (t->root)
+    {
+        tlv_node_destroy(t, t->root);
+    }
+
+    if (t->mapping)
+    {
+        munmap(t->mapping, t->mappingsize);
+        t->mapping = NULL;
+    }
+
+    free(t);
+}
+
+/*
+ * get length from *l
+ */
+static size_t tlv_node_get_length(tlv* t, tlvnode* node)
+{
+    if (!t || !node)
+    {
+        return -1;
+    }
+
+    return tlv_codec_of(t)->get_length(t, node->l);
+}
+
+/*
+ * set *l from length
+ */
+static void tlv_node_set_l(tlv* t, tlvnode* node, size_t length)
+{
+    // a varint l is made from node->length by dumps
+    if (!t || !node || (t->varint & TLV_VARINT_L) || tlv_node_own_header(t, node))
+    {
+        return;
+    }
+
+    tlv_codec_of(t)->put_length(t, node->l, length);
+}
+
+typedef struct tlv_index_entry
+{
+    tlvnode* node;
+    size_t hash;
+    struct tlv_index_entry* next;
+} tlv_index_entry;
+
+/*
+ * index: two chained hash tables over the nodes reachable from root,
+ * one keyed by tag alone, the other by parent and tag
+ */
+struct tlv_index
+{
+    size_t bucketcount;
+    size_t count;
+    tlv_index_entry** bytag;
+    tlv_index_entry** bychild;
+    tlv_index_entry* freelist;
+};
+
+/*
+ * FNV-1a over the tag as a node would store it, zero padded to tlength
+ */
+static size_t tag_hash(const tlv* t, const tlvbyte* tvalue, size_t tlength)
+{
+    size_t i;
+    size_t hash = (size_t)14695981039346656037ULL;
+
+    for (i = 0; i < t->tlength; i++)
+    {
+        hash ^= i < tlength ? tvalue[i] : 0x00;
+        hash *= (size_t)1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static size_t child_hash(size_t taghash, const tlvnode* parent)
+{
+    size_t p = (size_t)parent;
+    return taghash ^ ((p >> 4) * (size_t)0x9E3779B97F4A7C15ULL);
+}
+
+static int tag_bytes_equal(const tlv* t, const tlvbyte* ntag, const tlvbyte* tvalue, size_t tlength)
+{
+    size_t i;
+    size_t n = tlength < t->tlength ? tlength : t->tlength;
+
+    if (memcmp(ntag, tvalue, n))
+    {
+        return 0;
+    }
+
+    for (i = n; i < t->tlength; i++)
+    {
+        if (ntag[i])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int tag_equals(const tlv* t, const tlvnode* node, const tlvbyte* tvalue, size_t tlength)
+{
+    return tag_bytes_equal(t, node->t, tvalue, tlength);
+}
+
+static void index_destroy(struct tlv_index* index)
+{
+    size_t i;
+    tlv_index_entry* e;
+
+    if (!index)
+    {
+        return;
+    }
+
+    for (i = 0; i < index->bucketcount; i++)
+    {
+        while ((e = index->bytag[i]))
+        {
+            index->bytag[i] = e->next;
+            free(e);
+        }
+
+        while ((e = index->bychild[i]))
+        {
+            index->bychild[i] = e->next;
+            free(e);
+        }
+    }
+
+    while ((e = index->freelist))
+    {
+        index->freelist = e->next;
+        free(e);
+    }
+
+    free(index->bytag);
+    free(index->bychild);
+    free(index);
+}
+
+static struct tlv_index* index_obtain(size_t bucketcount)
+{
+    struct tlv_index* index = (struct tlv_index*)malloc(sizeof(struct tlv_index));
+    if (!index)
+    {
+        return NULL;
+    }
+
+    index->bucketcount = bucketcount;
+    index->count = 0;
+    index->freelist = NULL;
+    index->bytag = (tlv_index_entry**)calloc(bucketcount, sizeof(tlv_index_entry*));
+    index->bychild = (tlv_index_entry**)calloc(bucketcount, sizeof(tlv_index_entry*));
+    if (!index->bytag || !index->bychild)
+    {
+        index_destroy(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+static void index_rehash_table(tlv_index_entry** from, size_t fromcount,
+                               tlv_index_entry** to, size_t tocount)
+{
+    size_t i;
+
+    for (i = 0; i < fromcount; i++)
+    {
+        tlv_index_entry* e = from[i];
+        while (e)
+        {
+            tlv_index_entry* next = e->next;
+            e->next = to[e->hash % tocount];
+            to[e->hash % tocount] = e;
+            e = next;
+        }
+    }
+}
+
+/*
+ * double buckets when the tables get crowded
+ */
+static void index_grow(struct tlv_index* index)
+{
+    size_t newcount = index->bucketcount * 2;
+    tlv_index_entry** bytag = (tlv_index_entry**)calloc(newcount, sizeof(tlv_index_entry*));
+    tlv_index_entry** bychild = (tlv_index_entry**)calloc(newcount, sizeof(tlv_index_entry*));
+
+    if (!bytag || !bychild)
+    {
+        // keep the old tables, only chains get longer
+        free(bytag);
+        free(bychild);
+        return;
+    }
+
+    index_rehash_table(index->bytag, index->bucketcount, bytag, newcount);
+    index_rehash_table(index->bychild, index->bucketcount, bychild, newcount);
+    free(index->bytag);
+    free(index->bychild);
+    index->bytag = bytag;
+    index->bychild = bychild;
+    index->bucketcount = newcount;
+}
+
+static tlv_index_entry* index_entry_obtain(struct tlv_index* index, tlvnode* node, size_t hash)
+{
+    tlv_index_entry* e = index->freelist;
+
+    if (e)
+    {
+        index->freelist = e->next;
+    }
+    else if (!(e = (tlv_index_entry*)malloc(sizeof(tlv_index_entry))))
+    {
+        return NULL;
+    }
+
+    e->node = node;
+    e->hash = hash;
+
+    return e;
+}
+
+/*
+ * forget the index of t, lookups go back to walking the tree
+ */
+static void index_drop(tlv* t)
+{
+    struct tlv_index* index = t->index;
+    size_t i;
+
+    for (i = 0; i < index->bucketcount; i++)
+    {
+        tlv_index_entry* e;
+
+        for (e = index->bytag[i]; e; e = e->next)
+        {
+            e->node->flags &= ~NODE_FLAG_INDEXED;
+        }
+    }
+
+    index_destroy(index);
+    t->index = NULL;
+}
+
+/*
+ * returns: 0 if succeed, -1 if out of memory, the index is dropped then
+ */
+static int index_insert(tlv* t, tlvnode* node)
+{
+    struct tlv_index* index = t->index;
+    size_t hash = tag_hash(t, node->t, t->tlength);
+    tlv_index_entry* e;
+    tlv_index_entry* c;
+
+    if (node->flags & NODE_FLAG_INDEXED)
+    {
+        return 0;
+    }
+
+    if (index->count >= index->bucketcount)
+    {
+        index_grow(index);
+    }
+
+    e = index_entry_obtain(index, node, hash);
+    c = index_entry_obtain(index, node, child_hash(hash, node->parent));
+    if (!e || !c)
+    {
+        // a partial index would miss nodes, none at all is only slower
+        free(e);
+        free(c);
+        index_drop(t);
+        return -1;
+    }
+
+    e->next = index->bytag[e->hash % index->bucketcount];
+    index->bytag[e->hash % index->bucketcount] = e;
+    c->next = index->bychild[c->hash % index->bucketcount];
+    index->bychild[c->hash % index->bucketcount] = c;
+
+    index->count++;
+    node->flags |= NODE_FLAG_INDEXED;
+
+    return 0;
+}
+
+static void index_unlink(struct tlv_index* index, tlv_index_entry** table, size_t hash, const tlvnode* node)
+{
+    tlv_index_entry** pe = &table[hash % index->bucketcount];
+
+    while (*pe)
+    {
+        tlv_index_entry* e = *pe;
+        if (e->node == node)
+        {
+            *pe = e->next;
+            e->next = index->freelist;
+            index->freelist = e;
+            return;
+        }
+
+        pe = &e->next;
+    }
+}
+
+static void index_remove(tlv* t, tlvnode* node)
+{
+    size_t hash;
+
+    if (!(node->flags & NODE_FLAG_INDEXED))
+    {
+        return;
+    }
+
+    hash = tag_hash(t, node->t, t->tlength);
+    index_unlink(t->index, t->index->bytag, hash, node);
+    index_unlink(t->index, t->index->bychild, child_hash(hash, node->parent), node);
+
+    t->index->count--;
+    node->flags &= ~NODE_FLAG_INDEXED;
+}
+
+/*
+ * add or remove every materialized node under top, top included,
+ * adding stops once the index is dropped.
+ * preorder by parent pointers, no stack needed
+ */
+static void index_subtree(tlv* t, tlvnode* top, int add)
+{
+    tlvnode* node = top;
+
+    while (node)
+    {
+        if (add)
+        {
+            if (index_insert(t, node))
+            {
+                return;
+            }
+        }
+        else
+        {
+            index_remove(t, node);
+        }
+
+        if (node->firstChild)
+        {
+            node = node->firstChild;
+            continue;
+        }
+
+        while (node != top && !node->nextSubling)
+        {
+            node = node->parent;
+        }
+
+        node = node == top ? NULL : node->nextSubling;
+    }
+}
+
+/*
+ * root of t was replaced, index the new tree from scratch
+ */
+static void index_reset(tlv* t)
+{
+    struct tlv_index* index = t->index;
+    size_t i;
+
+    if (!index)
+    {
+        return;
+    }
+
+    for (i = 0; i < index->bucketcount; i++)
+    {
+        tlv_index_entry* e;
+
+        while ((e = index->bytag[i]))
+        {
+            index->bytag[i] = e->next;
+            e->node->flags &= ~NODE_FLAG_INDEXED;
+            e->next = index->freelist;
+            index->freelist = e;
+        }
+
+        while ((e = index->bychild[i]))
+        {
+            index->bychild[i] = e->next;
+            e->next = index->freelist;
+            index->freelist = e;
+        }
+    }
+
+    index->count = 0;
+
+    if (t->root)
+    {
+        index_subtree(t, t->root, 1);
+    }
+}
+
+int tlv_use_index(tlv* t)
+{
+    if (!t)
+    {
+        return -1;
+    }
+
+    if (!t->index)
+    {
+        t->index = index_obtain(INDEX_INIT_BUCKETS);
+        if (!t->index)
+        {
+            return -1;
+        }
+
+        index_reset(t);
+    }
+
+    return t->index ? 0 : -1;
+}
+
+tlvnode* tlv_node_find_child(tlv* t, tlvnode* parent, const tlvbyte* tvalue, size_t tlength)
+{
+    tlv_index_entry* e;
+    size_t hash;
+
+    if (!t || !parent || !tvalue)
+    {
+        return NULL;
+    }
+
+    if (tlv_node_materialize(t, parent) < 0)
+    {
+        // children of parent could not be decoded
+        return NULL;
+    }
+
+    if (!t->index || !(parent->flags & NODE_FLAG_INDEXED))
+    {
+        // no index to help, walk the sublings
+        tlvnode* child;
+        for (child = parent->firstChild; child; child = child->nextSubling)
+        {
+            if (tag_equals(t, child, tvalue, tlength))
+            {
+                return child;
+            }
+        }
+
+        return NULL;
+    }
+
+    hash = child_hash(tag_hash(t, tvalue, tlength), parent);
+    for (e = t->index->bychild[hash % t->index->bucketcount]; e; e = e->next)
+    {
+        if (e->hash == hash && e->node->parent == parent
+                && tag_equals(t, e->node, tvalue, tlength))
+        {
+            return e->node;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * returns: none 0 if node sits in the subtree of top, top excluded
+ */
+static int is_descendant(const tlvnode* node, const tlvnode* top)
+{
+    for (node = node->parent; node; node = node->parent)
+    {
+        if (node == top)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+size_t tlv_node_find_descendants(tlv* t, tlvnode* node, const tlvbyte* tvalue, size_t tlength,
+                                 tlvnode** found, size_t foundsize)
+{
+    tlvnode* cur;
+    tlv_index_entry* e;
+    size_t hash;
+    size_t count = 0;
+
+    if (!t || !node || !tvalue || !t->index || !(node->flags & NODE_FLAG_INDEXED))
+    {
+        return 0;
+    }
+
+    // lazy parts have to be decoded, materializing indexes them
+    for (cur = node; cur; )
+    {
+        if (tlv_node_materialize(t, cur) < 0)
+        {
+            return 0;
+        }
+
+        if (cur->firstChild)
+        {
+            cur = cur->firstChild;
+            continue;
+        }
+
+        while (cur != node && !cur->nextSubling)
+        {
+            cur = cur->parent;
+        }
+
+        cur = cur == node ? NULL : cur->nextSubling;
+    }
+
+    if (!t->index)
+    {
+        // dropped while indexing what was decoded
+        return 0;
+    }
+
+    hash = tag_hash(t, tvalue, tlength);
+    for (e = t->index->bytag[hash % t->index->bucketcount]; e; e = e->next)
+    {
+        if (e->hash == hash && tag_equals(t, e->node, tvalue, tlength)
+                && is_descendant(e->node, node))
+        {
+            if (count < foundsize && found)
+            {
+                found[count] = e->node;
+            }
+
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * take dirty node out of its parent's dirty list
+ */
+static void dirty_unlink(tlvnode* node)
+{
+    if (node->dirtyPrev)
+    {
+        node->dirtyPrev->dirtyNext = node->dirtyNext;
+    }
+    else if (node->parent)
+    {
+        node->parent->dirtyFirst = node->dirtyNext;
+    }
+
+    if (node->dirtyNext)
+    {
+        node->dirtyNext->dirtyPrev = node->dirtyPrev;
+    }
+
+    node->dirtyNext = node->dirtyPrev = NULL;
+}
+
+/*
+ * mark node dirty, together with the path up to the first dirty
+ * ancestor. a dirty node always sits in the dirty list of its parent,
+ * so tlv_layout can reach it from the root.
+ */
+static void mark_dirty(tlvnode* node)
+{
+    while (node && !(node->flags & NODE_FLAG_DIRTY))
+    {
+        node->flags |= NODE_FLAG_DIRTY;
+        if (node->parent)
+        {
+            node->dirtyPrev = NULL;
+            node->dirtyNext = node->parent->dirtyFirst;
+            if (node->dirtyNext)
+            {
+                node->dirtyNext->dirtyPrev = node;
+            }
+
+            node->parent->dirtyFirst = node;
+        }
+
+        node = node->parent;
+    }
+}
+
+static size_t varint_size(size_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+static size_t varint_put(tlvbyte* p, size_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80)
+    {
+        p[n++] = (tlvbyte)(v | 0x80);
+        v >>= 7;
+    }
+
+    p[n++] = (tlvbyte)v;
+
+    return n;
+}
+
+/*
+ * decode a varint of at most avail bytes, only the shortest
+ * encoding of a value is taken, so sizes computed from values
+ * match the bytes they were loaded from
+ * returns: bytes taken, 0 if malformed
+ */
+static size_t varint_get(const tlvbyte* p, size_t avail, size_t* v)
+{
+    size_t value = 0;
+    size_t n;
+
+    // one byte is the common case
+    if (avail > 0 && p[0] < 0x80)
+    {
+        *v = p[0];
+        return 1;
+    }
+
+    for (n = 0; n < avail && n * 7 < 8 * sizeof(size_t); n++)
+    {
+        value |= (size_t)(p[n] & 0x7f) << (n * 7);
+
+        if (p[n] < 0x80)
+        {
+            if (p[n] == 0 || (n * 7 + 7 > 8 * sizeof(size_t) && p[n] >> (8 * sizeof(size_t) - n * 7)))
+            {
+                return 0;
+            }
+
+            *v = value;
+            return n + 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * tag bytes without the zero padding
+ */
+static size_t tag_significant(const tlv* t, const tlvbyte* tag)
+{
+    size_t k = t->tlength;
+
+    while (k > 0 && !tag[k - 1])
+    {
+        k--;
+    }
+
+    return k;
+}
+
+/*
+ * bytes of the header of node in dump
+ */
+static size_t header_size(const tlv* t, const tlvnode* node)
+{
+    size_t size = t->alength;
+
+    if (!t->varint)
+    {
+        return size + t->tlength + t->llength;
+    }
+
+    if (t->varint & TLV_VARINT_T)
+    {
+        size_t k = tag_significant(t, node->t);
+        size += varint_size(k) + k;
+    }
+    else
+    {
+        size += t->tlength;
+    }
+
+    size += t->varint & TLV_VARINT_L ? varint_size(node->length) : t->llength;
+
+    return size;
+}
+
+/*
+ * write the header of node with varint fields into dst
+ * returns: bytes written, header_size() of them
+ */
+static size_t varint_write_header(const tlv* t, tlvbyte* dst, const tlvnode* node)
+{
+    size_t n = t->alength;
+
+    memcpy(dst, node->a, t->alength);
+
+    if (t->varint & TLV_VARINT_T)
+    {
+        size_t k = tag_significant(t, node->t);
+        n += varint_put(dst + n, k);
+        memcpy(dst + n, node->t, k);
+        n += k;
+    }
+    else
+    {
+        memcpy(dst + n, node->t, t->tlength);
+        n += t->tlength;
+    }
+
+    if (t->varint & TLV_VARINT_L)
+    {
+        n += varint_put(dst + n, node->length);
+    }
+    else
+    {
+        memcpy(dst + n, node->l, t->llength);
+        n += t->llength;
+    }
+
+    return n;
+}
+
+/*
+ * read a header with varint fields from src of avail bytes into hdr,
+ * a, t, l back to back and zeroed, as node_alloc leaves them
+ * returns: bytes taken, 0 if malformed
+ */
+static size_t varint_read_header(const tlv* t, const tlv_codec* codec, const tlvbyte* src, size_t avail,
+                                 tlvbyte* hdr, size_t* length)
+{
+    size_t n = t->alength;
+    size_t m;
+
+    if (avail < n)
+    {
+        return 0;
+    }
+
+    memcpy(hdr, src, t->alength);
+
+    if (t->varint & TLV_VARINT_T)
+    {
+        size_t k;
+
+        // the padding is not on the wire, a zero last byte is malformed
+        m = varint_get(src + n, avail - n, &k);
+        if (!m || k > t->tlength || k > avail - n - m || (k && !src[n + m + k - 1]))
+        {
+            return 0;
+        }
+
+        memcpy(hdr + t->alength, src + n + m, k);
+        n += m + k;
+    }
+    else
+    {
+        if (avail - n < t->tlength)
+        {
+            return 0;
+        }
+
+        memcpy(hdr + t->alength, src + n, t->tlength);
+        n += t->tlength;
+    }
+
+    if (t->varint & TLV_VARINT_L)
+    {
+        m = varint_get(src + n, avail - n, length);
+        if (!m)
+        {
+            return 0;
+        }
+
+        n += m;
+    }
+    else
+    {
+        if (avail - n < t->llength)
+        {
+            return 0;
+        }
+
+        memcpy(hdr + t->alength + t->tlength, src + n, t->llength);
+        *length = codec->get_length(t, src + n);
+        n += t->llength;
+    }
+
+    return n;
+}
+
+/*
+ * bytes node takes in dump, header included
+ */
+static size_t node_dump_size(const tlv* t, const tlvnode* node)
+{
+    return header_size(t, node) + node->length;
+}
+
+/*
+ * carry a change of the dump size of node up to every ancestor,
+ * marking the path dirty for tlv_layout
+ * oldsize: node_dump_size() of node before the change
+ */
+static void node_size_changed(tlv* t, tlvnode* node, size_t oldsize)
+{
+    tlvnode* p;
+
+    mark_dirty(node);
+
+    for (p = node->parent; p; node = p, p = p->parent)
+    {
+        size_t poldsize = node_dump_size(t, p);
+        p->length = p->length - oldsize + node_dump_size(t, node);
+        oldsize = poldsize;
+    }
+}
+
+/*
+ * set length of node, and carry the change of its dump size up
+ */
+static void tlv_node_resize(tlv* t, tlvnode* node, size_t length)
+{
+    size_t oldsize;
+
+    if (node->length == length)
+    {
+        return;
+    }
+
+    oldsize = node_dump_size(t, node);
+    node->length = length;
+    node_size_changed(t, node, oldsize);
+}
+
+/*
+ * append child to the children of parent, lengths untouched
+ */
+static void tlv_node_link_child(tlv* t, tlvnode* parent, tlvnode* child)
+{
+    tlvnode* lastChild = parent->lastChild;
+    if (lastChild)
+    {
+        lastChild->nextSubling = child;
+        child->prevSubling = lastChild;
+    }
+    else // parent without child
+    {
+        parent->firstChild = child;
+        child->prevSubling = NULL;
+    }
+
+    child->nextSubling = NULL;
+    parent->lastChild = child;
+    child->parent = parent;
+    ++parent->childCount;
+
+    if (parent->flags & NODE_FLAG_INDEXED)
+    {
+        // joins the tree under root, so the index takes it
+        index_subtree(t, child, 1);
+    }
+}
+
+/*
+ * make a view node from the header at bytes, its children if any
+ * are left in bytes for tlv_node_materialize
+ */
+static tlvnode* node_from_view(tlv* t, const tlv_codec* codec, tlvbyte* bytes)
+{
+    tlvnode* node = node_alloc(t, 0);
+    if (!node)
+    {
+        return NULL;
+    }
+
+    node->a = bytes;
+    node->t = node->a + t->alength;
+    node->l = node->t + t->tlength;
+    node->length = codec->get_length(t, node->l);
+    node->flags |= NODE_FLAG_VIEW_HDR;
+
+    if (!tlv_node_get_attributes(t, node, TLV_NODE_ATTR_IS_STRUCTUAL))
+    {
+        node->v = node->l + t->llength;
+        node->flags |= NODE_FLAG_VIEW_V;
+    }
+    else if (node->length > 0)
+    {
+        node->v = node->l + t->llength;
+        node->flags |= NODE_FLAG_VIEW_V | NODE_FLAG_LAZY;
+    }
+
+    return node;
+}
+
+/*
+ * lazy load: decode root header only, see TLV_LOAD_LAZY
+ */
+static size_t tlv_loads_lazy(tlv* t, tlvbyte* bytes, size_t size)
+{
+    const tlv_codec* codec = tlv_codec_of(t);
+    size_t hdrsize = t->alength + t->tlength + t->llength;
+    tlvnode* root;
+
+    if (size < hdrsize)
+    {
+        return 0;
+    }
+
+    root = node_from_view(t, codec, bytes);
+    if (!root)
+    {
+        return 0;
+    }
+
+    if (root->length > size - hdrsize)
+    {
+        tlv_node_destroy(t, root);
+        return 0;
+    }
+
+    t->root = root;
+    index_reset(t);
+
+    return hdrsize + root->length;
+}
+
+int tlv_node_materialize(tlv* t, tlvnode* node)
+{
+    const tlv_codec* codec;
+    size_t hdrsize;
+    tlvbyte* p;
+    tlvbyte* end;
+    int res = 0;
+
+    if (!t || !node)
+    {
+        return -1;
+    }
+
+    if (!(node->flags & NODE_FLAG_LAZY))
+    {
+        return 0;
+    }
+
+    codec = tlv_codec_of(t);
+    hdrsize = t->alength + t->tlength + t->llength;
+    p = node->v;
+    end = node->v + node->length;
+
+    node->v = NULL;
+    node->flags &= ~(NODE_FLAG_VIEW_V | NODE_FLAG_LAZY);
+
+    // one level only, grandchildren wait behind their L
+    while (p < end)
+    {
+        tlvnode* child;
+
+        if ((size_t)(end - p) < hdrsize)
+        {
+            res = -1;
+            break;
+        }
+
+        child = node_from_view(t, codec, p);
+        if (!child)
+        {
+            res = -1;
+            break;
+        }
+
+        if (child->length > (size_t)(end - p) - hdrsize)
+        {
+            // overruns its parent
+            tlv_node_destroy(t, child);
+            res = -1;
+            break;
+        }
+
+        tlv_node_link_child(t, node, child);
+        p += hdrsize + child->length;
+    }
+
+    return res;
+}
+
+tlvnode* tlv_node_first_child(tlv* t, tlvnode* node)
+{
+    if (!node || tlv_node_materialize(t, node) < 0)
+    {
+        return NULL;
+    }
+
+    return node->firstChild;
+}
+
+/*
+ * load bytes into tlv node tree.
+ * defination for tlv should be set into original tlv struct.
+ * if succeed, tlv node tree should be set to tlv->root.
+ * returns the node count.
+ */
+size_t tlv_loads(tlv* tlv, tlvbyte* bytes, size_t size)
+{
+    size_t byteshandled;
+    _stack* lstack;
+
+    if (!tlv || !bytes || size <= 0)
+    {
+        return 0;
+    }
+
+    STATS_TIME_BEGIN(start);
+
+    // varint headers leave nothing to borrow for lazy nodes, values are viewed
+    if (tlv->loadmode == TLV_LOAD_LAZY && !tlv->varint)
+    {
+        byteshandled = tlv_loads_lazy(tlv, bytes, size);
+    }
+    else
+    {
+        lstack = stack_obtain(STACK_INIT_SIZE);
+        byteshandled = loads_tree(tlv, bytes, size, lstack);
+        stack_destroy(lstack);
+    }
+
+    STATS_TIME_END(tlv, loadsns, start);
+
+    return byteshandled;
+}
+
+/*
+ * eager load of one tree, lstack is scratch for the nesting
+ * and may be shared between calls
+ */
+static size_t loads_tree(tlv* tlv, tlvbyte* bytes, size_t size, _stack* lstack)
+{
+    tlvnode* root = NULL;
+    size_t byteshandled;
+
+    tlv_codec_of(tlv);
+    byteshandled = loads_nodes(tlv, bytes, size, lstack, &root);
+
+    if (root)
+    {
+        // kept on failure too, so tlv_destroy releases what was built
+        tlv->root = root;
+        index_reset(tlv);
+    }
+
+    return byteshandled;
+}
+
+/*
+ * decode the node at bytes with its subtree, not linked anywhere.
+ * *top gets the node as soon as it is made, tlv is not written,
+ * so workers may decode disjoint subtrees for one tlv at once.
+ */
+static size_t loads_nodes(tlv* tlv, tlvbyte* bytes, size_t size, _stack* lstack, tlvnode** top)
+{
+    size_t byteshandled = 0;
+    size_t nodecount = 0;
+    tlvnode* curparent;
+    tlvnode* root = NULL;
+
+    lstack->index = 0;
+
+    size_t index = 0;
+    tlv_node_attr_t attr = TLV_NODE_ATTR_IS_STRUCTUAL;
+    int view = tlv->loadmode != TLV_LOAD_COPY;
+    // varint headers are always copied out, values may still be borrowed
+    int viewhdr = view && !tlv->varint;
+    const tlv_codec* codec = codec_lookup(tlv);
+    size_t hdrsize = tlv->alength + tlv->tlength + tlv->llength;
+
+    while (index < size)
+    {
+        if (byteshandled > 0)
+        {
+            if (index >= byteshandled)
+            {
+                break;
+            }
+        }
+
+        int hasChild;
+        // the node should fit in its parent, or in bytes for root
+        size_t end = stack_length(lstack) > 0
+                   ? (size_t)lstack->data[lstack->index - 1]
+                   : size;
+
+        if (!tlv->varint && end - index < hdrsize)
+        {
+            return 0;
+        }
+
+        tlvnode *node = node_alloc(tlv, !viewhdr);
+        if (!node)
+        {
+            return 0;
+        }
+
+        if (index == 0)
+        {
+            root = node;
+            curparent = root;
+            *top = root;
+        }
+        else
+        {
+            tlv_node_link_child(tlv, curparent, node);
+        }
+
+        nodecount += 1;
+
+        if (tlv->varint)
+        {
+            size_t n = varint_read_header(tlv, codec, bytes + index, end - index, node->a, &node->length);
+            if (!n)
+            {
+                return 0;
+            }
+
+            STATS_ADD(tlv, loadbytes, n);
+            index += n;
+        }
+        else
+        {
+            if (viewhdr)
+            {
+                node->a = bytes + index;
+                node->t = node->a + tlv->alength;
+                node->l = node->t + tlv->tlength;
+                node->flags |= NODE_FLAG_VIEW_HDR;
+            }
+            else
+            {
+                // a, t, l are back to back in the node block
+                codec->read_header(tlv, node->a, bytes + index);
+                STATS_ADD(tlv, loadbytes, hdrsize);
+            }
+
+            index += hdrsize;
+            node->length = codec->get_length(tlv, node->l);
+        }
+
+        if (node->length > end - index)
+        {
+            return 0;
+        }
+
+        hasChild = tlv_node_get_attributes(tlv, node, attr);
+        if (hasChild) //have child
+        {
+            // end offset of the children rides on the stack itself
+            stack_push(lstack, (void*)(index + node->length));
+            curparent = node;
+        }
         else //have no child
         {
-            size_t vi;
-            node->v = (tlvbyte*)malloc(node->length);
-            for (vi = 0; vi < node->length; vi++)
+            if (view)
+            {
+                node->v = bytes + index;
+                node->flags |= NODE_FLAG_VIEW_V;
+                index += node->length;
+            }
+            else
+            {
+                node->v = (tlvbyte*)tlv_alloc(tlv, node->length);
+                memcpy(node->v, bytes + index, node->length);
+                STATS_ADD(tlv, loadbytes, node->length);
+                index += node->length;
+            }
+        }
+
+        // close every parent ending here, an empty constructed node too
+        while (stack_length(lstack) > 0)
+        {
+            size_t n = (size_t)stack_pop(lstack);
+
+            if (n == index)
+            {
+                curparent = curparent->parent;
+                if (curparent == NULL)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                stack_push(lstack, (void*)n);
+                break;
+            }
+        }
+
+        if (node == root)
+        {
+            byteshandled = node_dump_size(tlv, root);
+        }
+
+    } // index < size
+
+    //tlv_layout(tlv);
+
+    return byteshandled;
+}
+
+
+size_t tlv_load_file(tlv* tlv, const char* path)
+{
+    int fd;
+    struct stat st;
+    tlvbyte* mapping;
+    tlvnode* prior;
+    size_t handled;
+
+    if (!tlv || !path || tlv->mapping)
+    {
+        return 0;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    if (fstat(fd, &st) || st.st_size <= 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    mapping = (tlvbyte*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    prior = tlv->root;
+    handled = tlv_loads(tlv, mapping, st.st_size);
+
+    if (tlv->loadmode != TLV_LOAD_COPY && handled > 0)
+    {
+        // nodes point into the mapping, it goes with the tlv
+        tlv->mapping = mapping;
+        tlv->mappingsize = st.st_size;
+    }
+    else
+    {
+        if (tlv->loadmode != TLV_LOAD_COPY && tlv->root != prior)
+        {
+            // a partial tree borrows from the mapping, it goes first
+            tlv_node_destroy(tlv, tlv->root);
+            tlv->root = NULL;
+        }
+
+        munmap(mapping, st.st_size);
+    }
+
+    return handled;
+}
+
+size_t tlv_dump_file(tlv* tlv, const char* path)
+{
+    int fd;
+    size_t size;
+    size_t dumped;
+    tlvbyte* mapping;
+
+    if (!tlv || !tlv->root || !path)
+    {
+        return 0;
+    }
+
+    size = tlv_layout(tlv);
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    // size the file first, then dump straight into its pages.
+    // blocks are reserved, not just the length set, so a full disk
+    // fails here instead of raising SIGBUS on a store into the mapping
+    if (posix_fallocate(fd, 0, size))
+    {
+        close(fd);
+        return 0;
+    }
+
+    mapping = (tlvbyte*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    dumped = tlv_dumps(tlv, mapping, size);
+
+    // write back errors only show up here
+    if (msync(mapping, size, MS_SYNC))
+    {
+        dumped = 0;
+    }
+
+    if (munmap(mapping, size))
+    {
+        dumped = 0;
+    }
+
+    return dumped == size ? size : 0;
+}
+
+/*
+ * end offsets of the open constructed nodes for tlv_validate, the
+ * first VALIDATE_DEPTH of them on the stack of the caller
+ */
+typedef struct
+{
+    size_t local[VALIDATE_DEPTH];
+    _stack* deep;
+    size_t depth;
+} validate_ends;
+
+static int ends_push(validate_ends* ends, size_t end)
+{
+    if (ends->depth < VALIDATE_DEPTH)
+    {
+        ends->local[ends->depth++] = end;
+        return 0;
+    }
+
+    if (!ends->deep)
+    {
+        ends->deep = stack_obtain(STACK_INIT_SIZE);
+    }
+
+    if (stack_push(ends->deep, (void*)end) < 0)
+    {
+        return -1;
+    }
+
+    ends->depth++;
+    return 0;
+}
+
+static size_t ends_top(const validate_ends* ends)
+{
+    if (ends->depth > VALIDATE_DEPTH)
+    {
+        return (size_t)ends->deep->data[ends->deep->index - 1];
+    }
+
+    return ends->local[ends->depth - 1];
+}
+
+static void ends_pop(validate_ends* ends)
+{
+    if (ends->depth > VALIDATE_DEPTH)
+    {
+        stack_pop(ends->deep);
+    }
+
+    ends->depth--;
+}
+
+size_t tlv_validate(const tlvbyte* bytes, size_t size, const tlv* geometry, size_t* erroffset)
+{
+    const tlv_codec* codec;
+    size_t hdrsize;
+    size_t index = 0;
+    size_t msgsize = 0;
+    validate_ends ends;
+
+    if (erroffset)
+    {
+        *erroffset = 0;
+    }
+
+    if (!bytes || !geometry || geometry->varint)
+    {
+        return 0;
+    }
+
+    codec = codec_lookup(geometry);
+    hdrsize = geometry->alength + geometry->tlength + geometry->llength;
+    ends.deep = NULL;
+    ends.depth = 0;
+
+    do
+    {
+        size_t end = ends.depth > 0 ? ends_top(&ends) : size;
+        size_t length;
+
+        // header, then content, should fit in the parent
+        if (end - index < hdrsize)
+        {
+            break;
+        }
+
+        length = codec->get_length(geometry, bytes + index + geometry->alength + geometry->tlength);
+        if (length > end - index - hdrsize)
+        {
+            break;
+        }
+
+        if (index == 0)
+        {
+            msgsize = hdrsize + length;
+        }
+
+        if (attr_bit(bytes + index, TLV_NODE_ATTR_IS_STRUCTUAL) && length > 0)
+        {
+            // children should tile the content exactly, checked
+            // as each of them ends
+            if (ends_push(&ends, index + hdrsize + length) < 0)
+            {
+                break;
+            }
+
+            index += hdrsize;
+            continue;
+        }
+
+        // leaf: payload is skipped by l, never read
+        index += hdrsize + length;
+
+        while (ends.depth > 0 && ends_top(&ends) == index)
+        {
+            ends_pop(&ends);
+        }
+    } while (ends.depth > 0);
+
+    stack_destroy(ends.deep);
+
+    if (ends.depth > 0 || index != msgsize || msgsize != size)
+    {
+        // bad header, or bytes left after root
+        if (erroffset)
+        {
+            *erroffset = index;
+        }
+
+        return 0;
+    }
+
+    return msgsize;
+}
+
+int tlv_find_path(const tlvbyte* bytes, size_t size, const tlv* geometry,
+                  const tlv_path_step* path, size_t pathlength,
+                  size_t* voffset, size_t* vlength)
+{
+    const tlv_codec* codec;
+    size_t hdrsize;
+    size_t begin = 0;
+    size_t end = size;
+    size_t step;
+
+    if (!bytes || !geometry || geometry->varint || (!path && pathlength > 0))
+    {
+        return -1;
+    }
+
+    codec = codec_lookup(geometry);
+    hdrsize = geometry->alength + geometry->tlength + geometry->llength;
+
+    for (step = 0; step < pathlength; step++)
+    {
+        size_t p = begin;
+        size_t seen = 0;
+        int found = 0;
+
+        while (p < end)
+        {
+            const tlvbyte* a = bytes + p;
+            const tlvbyte* t = a + geometry->alength;
+            size_t length;
+
+            if (end - p < hdrsize)
+            {
+                return -1;
+            }
+
+            length = codec->get_length(geometry, t + geometry->tlength);
+            if (length > end - p - hdrsize)
+            {
+                return -1;
+            }
+
+            if ((!path[step].t || tag_bytes_equal(geometry, t, path[step].t, path[step].tlength))
+                && seen++ == path[step].nth)
+            {
+                if (step + 1 < pathlength && !attr_bit(a, TLV_NODE_ATTR_IS_STRUCTUAL))
+                {
+                    // path goes on below a leaf
+                    return 1;
+                }
+
+                begin = p + hdrsize;
+                end = begin + length;
+                found = 1;
+                break;
+            }
+
+            // hop over the whole subtree by its l
+            p += hdrsize + length;
+        }
+
+        if (!found)
+        {
+            return 1;
+        }
+    }
+
+    if (voffset)
+    {
+        *voffset = begin;
+    }
+    if (vlength)
+    {
+        *vlength = end - begin;
+    }
+
+    return 0;
+}
+
+
+struct tlv_decoder
+{
+    tlv* tlv;
+    _stack* ends; // end offsets of the open constructed nodes
+    tlvnode* parent; // innermost open constructed node
+    tlvnode* node; // node whose header or value is being filled
+    size_t filled; // bytes of node header or value filled so far
+    int invalue;
+    size_t offset; // bytes consumed since message start
+    size_t rootend; // 0 until root header is complete
+    tlv_decode_status_t status;
+};
+
+tlv_decoder* tlv_decoder_obtain(tlv* tlv)
+{
+    tlv_decoder* dec;
+
+    if (!tlv || tlv->varint)
+    {
+        return NULL;
+    }
+
+    dec = (tlv_decoder*)malloc(sizeof(tlv_decoder));
+    if (!dec)
+    {
+        return NULL;
+    }
+
+    dec->ends = stack_obtain(STACK_INIT_SIZE);
+    if (!dec->ends)
+    {
+        free(dec);
+        return NULL;
+    }
+
+    dec->node = NULL;
+    tlv_decoder_reset(dec, tlv);
+
+    return dec;
+}
+
+/*
+ * drop the node that is not hooked into any tree yet,
+ * its header is incomplete or it failed to link
+ */
+static void decoder_drop_pending(tlv_decoder* dec)
+{
+    if (dec->node && !dec->invalue)
+    {
+        tlv_node_destroy(dec->tlv, dec->node);
+    }
+
+    dec->node = NULL;
+}
+
+void tlv_decoder_destroy(tlv_decoder* dec)
+{
+    if (!dec)
+    {
+        return;
+    }
+
+    decoder_drop_pending(dec);
+    stack_destroy(dec->ends);
+    free(dec);
+}
+
+void tlv_decoder_reset(tlv_decoder* dec, tlv* tlv)
+{
+    if (!dec)
+    {
+        return;
+    }
+
+    decoder_drop_pending(dec);
+    dec->tlv = tlv;
+    dec->ends->index = 0;
+    dec->parent = NULL;
+    dec->filled = 0;
+    dec->invalue = 0;
+    dec->offset = 0;
+    dec->rootend = 0;
+    dec->status = tlv && tlv->varint ? TLV_DECODE_ERROR : TLV_DECODE_NEED_MORE;
+}
+
+/*
+ * current node is done: close every constructed node ending here
+ */
+static void decoder_close_nodes(tlv_decoder* dec)
+{
+    dec->node = NULL;
+    dec->filled = 0;
+    dec->invalue = 0;
+
+    while (stack_length(dec->ends) > 0)
+    {
+        size_t end = (size_t)stack_pop(dec->ends);
+
+        if (end != dec->offset)
+        {
+            stack_push(dec->ends, (void*)end);
+            break;
+        }
+
+        dec->parent = dec->parent->parent;
+    }
+
+    if (dec->offset == dec->rootend)
+    {
+        dec->status = TLV_DECODE_COMPLETE;
+    }
+}
+
+/*
+ * header of current node is complete: hook it into the tree
+ * returns: 0 if succeed
+ */
+static int decoder_header_done(tlv_decoder* dec)
+{
+    tlv* t = dec->tlv;
+    tlvnode* node = dec->node;
+    int structual = tlv_node_get_attributes(t, node, TLV_NODE_ATTR_IS_STRUCTUAL);
+    size_t end;
+
+    node->length = tlv_node_get_length(t, node);
+    end = dec->offset + node->length;
+
+    if (dec->rootend > 0 && end > (size_t)dec->ends->data[dec->ends->index - 1])
+    {
+        // overruns its parent
+        decoder_drop_pending(dec);
+        return -1;
+    }
+
+    if (!structual && node->length > 0)
+    {
+        // before linking, so a failure leaves the node to drop
+        node->v = (tlvbyte*)tlv_alloc(t, node->length);
+        if (!node->v)
+        {
+            decoder_drop_pending(dec);
+            return -1;
+        }
+    }
+
+    if (dec->rootend == 0)
+    {
+        t->root = node;
+        dec->rootend = end;
+        index_reset(t);
+    }
+    else
+    {
+        tlv_node_link_child(t, dec->parent, node);
+    }
+
+    if (structual)
+    {
+        if (node->length > 0)
+        {
+            // the tree owns node from here on
+            dec->node = NULL;
+            dec->filled = 0;
+            if (stack_push(dec->ends, (void*)end) < 0)
+            {
+                return -1;
+            }
+
+            dec->parent = node;
+            return 0;
+        }
+    }
+    else if (node->length > 0)
+    {
+        dec->invalue = 1;
+        dec->filled = 0;
+        return 0;
+    }
+
+    decoder_close_nodes(dec);
+    return 0;
+}
+
+tlv_decode_status_t tlv_decoder_feed(tlv_decoder* dec, const tlvbyte* bytes, size_t size, size_t* consumed)
+{
+    size_t index = 0;
+
+    if (!dec || (!bytes && size > 0))
+    {
+        return TLV_DECODE_ERROR;
+    }
+
+    tlv* t = dec->tlv;
+    size_t hdrsize = t->alength + t->tlength + t->llength;
+
+    while (index < size && dec->status == TLV_DECODE_NEED_MORE)
+    {
+        size_t n;
+
+        if (dec->invalue)
+        {
+            // value bytes go straight into the leaf
+            n = dec->node->length - dec->filled;
+            if (n > size - index)
+            {
+                n = size - index;
+            }
+
+            memcpy(dec->node->v + dec->filled, bytes + index, n);
+            dec->filled += n;
+            dec->offset += n;
+            index += n;
+
+            if (dec->filled == dec->node->length)
+            {
+                decoder_close_nodes(dec);
+            }
+
+            continue;
+        }
+
+        if (!dec->node)
+        {
+            dec->node = node_alloc(t, 1);
+            if (!dec->node)
+            {
+                dec->status = TLV_DECODE_ERROR;
+                break;
+            }
+        }
+
+        // a, t, l are laid out back to back in the node block
+        n = hdrsize - dec->filled;
+        if (n > size - index)
+        {
+            n = size - index;
+        }
+
+        memcpy(dec->node->a + dec->filled, bytes + index, n);
+        dec->filled += n;
+        dec->offset += n;
+        index += n;
+
+        if (dec->filled == hdrsize)
+        {
+            if (decoder_header_done(dec))
+            {
+                dec->status = TLV_DECODE_ERROR;
+            }
+        }
+    }
+
+    if (consumed)
+    {
+        *consumed = index;
+    }
+
+    return dec->status;
+}
+
+size_t tlv_decoder_need(const tlv_decoder* dec)
+{
+    const tlv* t;
+
+    if (!dec || dec->status != TLV_DECODE_NEED_MORE)
+    {
+        return 0;
+    }
+
+    t = dec->tlv;
+    if (dec->rootend == 0)
+    {
+        return t->alength + t->tlength + t->llength - dec->filled;
+    }
+
+    return dec->rootend - dec->offset;
+}
+
+
+static size_t write_buf_from_index(tlv* tlv, const tlv_codec* codec, tlvnode* node, tlvbyte* buf, size_t bufsize, size_t index)
+{
+    int hasChild;
+    size_t hdrsize;
+    tlv_node_attr_t attr = TLV_NODE_ATTR_IS_STRUCTUAL;
+
+    if (!tlv || !node || !buf || bufsize <= 0 || index < 0)
+    {
+        return 0;
+    }
+
+    hasChild = tlv_node_get_attributes(tlv, node,attr);
+    hdrsize = header_size(tlv, node);
+
+    if (index + hdrsize
+            + (hasChild && !(node->flags & NODE_FLAG_LAZY) ? 0 : node->length) > bufsize)
+    {
+        return -1;
+    }
+
+    if (tlv->varint)
+    {
+        varint_write_header(tlv, buf + index, node);
+    }
+    else
+    {
+        codec->write_header(tlv, buf + index, node);
+    }
+
+    index += hdrsize;
+    STATS_ADD(tlv, dumpbytes, hdrsize);
+
+    // lazy node: its untouched subtree goes out as raw bytes
+    if ((!hasChild || (node->flags & NODE_FLAG_LAZY)) && node->length)
+    {
+        memcpy(buf + index, node->v, node->length);
+        index += node->length;
+        STATS_ADD(tlv, dumpbytes, node->length);
+    }
+
+    return index;
+}
+
+/*
+ * dump node with its subtree into buf from index on, it only reads
+ * the tree, lazy nodes go out as their bytes, so workers may dump
+ * disjoint subtrees at once.
+ * returns: index right after the subtree, -1 if buf is too small
+ */
+static size_t dumps_subtree(tlv* tlv, const tlv_codec* codec, tlvnode* node,
+                            tlvbyte* buf, size_t bufsize, size_t index)
+{
+    tlv_cursor c;
+
+    for (tlv_cursor_init(&c, tlv, node, TLV_CURSOR_PREORDER | TLV_CURSOR_SHALLOW);
+         c.node; tlv_cursor_next(&c))
+    {
+        STATS_MAX(tlv, peakdepth, c.depth + 1);
+        index = write_buf_from_index(tlv, codec, c.node, buf, bufsize, index);
+        if (index == (size_t)-1)
+        {
+            return -1;
+        }
+    }
+
+    return index;
+}
+
+/*
+ * dump tlv struct into bytes.
+ * returns byte length.
+ */
+size_t tlv_dumps(tlv* tlv, tlvbyte* buf, size_t bufsize)
+{
+    size_t needsize;
+    size_t buf_index = 0;
+
+    if (!tlv || !buf || bufsize < 0)
+    {
+        return -1;
+    }
+
+    STATS_TIME_BEGIN(start);
+    const tlv_codec* codec = tlv_codec_of(tlv);
+
+    needsize = node_dump_size(tlv, tlv->root);
+
+    buf_index = dumps_subtree(tlv, codec, tlv->root, buf, bufsize, buf_index);
+
+    STATS_TIME_END(tlv, dumpsns, start);
+    return buf_index == (size_t)-1 ? needsize : buf_index;
+}
+
+/*
+ * iovec output of tlv_dumpv in the making
+ */
+typedef struct
+{
+    struct iovec* iov;
+    size_t iovsize;
+    size_t count;
+    tlvbyte* scratch;
+    size_t scratchsize;
+    size_t used; // bytes of scratch taken
+} dumpv_out;
+
+/*
+ * append n bytes at p to the output, copied into scratch or pointed at
+ * returns: 0 if succeed, -1 if iov or scratch ran out
+ */
+static int dumpv_append(dumpv_out* out, const tlvbyte* p, size_t n, int copy)
+{
+    struct iovec* last = out->count ? &out->iov[out->count - 1] : NULL;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    if (copy)
+    {
+        if (out->scratchsize - out->used < n)
+        {
+            return -1;
+        }
+
+        memcpy(out->scratch + out->used, p, n);
+        p = out->scratch + out->used;
+        out->used += n;
+    }
+
+    // bytes right after the last entry make it longer
+    if (last && (tlvbyte*)last->iov_base + last->iov_len == p)
+    {
+        last->iov_len += n;
+        return 0;
+    }
+
+    if (out->count == out->iovsize)
+    {
+        return -1;
+    }
+
+    out->iov[out->count].iov_base = (void*)p;
+    out->iov[out->count].iov_len = n;
+    out->count++;
+
+    return 0;
+}
+
+size_t tlv_dumpv(tlv* tlv, struct iovec* iov, size_t iovsize, size_t* iovcount,
+                 tlvbyte* scratch, size_t scratchsize)
+{
+    const tlv_codec* codec;
+    size_t hdrsize;
+    size_t total = 0;
+    int failed = 0;
+    tlv_cursor c;
+    dumpv_out out;
+
+    if (iovcount)
+    {
+        *iovcount = 0;
+    }
+
+    if (!tlv || !tlv->root || tlv->varint || !iov || (!scratch && scratchsize > 0))
+    {
+        return 0;
+    }
+
+    codec = tlv_codec_of(tlv);
+    hdrsize = tlv->alength + tlv->tlength + tlv->llength;
+
+    out.iov = iov;
+    out.iovsize = iovsize;
+    out.count = 0;
+    out.scratch = scratch;
+    out.scratchsize = scratchsize;
+    out.used = 0;
+
+    for (tlv_cursor_init(&c, tlv, tlv->root, TLV_CURSOR_PREORDER | TLV_CURSOR_SHALLOW);
+         c.node; tlv_cursor_next(&c))
+    {
+        tlvnode* curnode = c.node;
+        int raw;
+
+        if (out.scratchsize - out.used < hdrsize)
+        {
+            failed = 1;
+            break;
+        }
+
+        // header goes to scratch as it is, then into the output
+        codec->write_header(tlv, out.scratch + out.used, curnode);
+        out.used += hdrsize;
+        if (dumpv_append(&out, out.scratch + out.used - hdrsize, hdrsize, 0) < 0)
+        {
+            failed = 1;
+            break;
+        }
+
+        // a leaf value, or untouched bytes of a lazy node
+        raw = !tlv_node_get_attributes(tlv, curnode, TLV_NODE_ATTR_IS_STRUCTUAL)
+            || (curnode->flags & NODE_FLAG_LAZY);
+
+        if (raw && dumpv_append(&out, curnode->v, curnode->length,
+                                curnode->length <= DUMPV_COPY_MAX) < 0)
+        {
+            failed = 1;
+            break;
+        }
+
+        total += hdrsize + (raw ? curnode->length : 0);
+    }
+
+    if (failed)
+    {
+        return 0;
+    }
+
+    if (iovcount)
+    {
+        *iovcount = out.count;
+    }
+
+    return total;
+}
+
+
+
+static void free_tlv_node(tlvnode* node)
+{
+    if (!node)
+    {
+        return;
+    }
+
+    tlv_node_free_v(node);
+
+    if (node->flags & NODE_FLAG_OWN_HDR)
+    {
+        tlv_free(node, node->a);
+    }
+
+    STATS_ADD(node->tlv, nodesdestroyed, 1);
+    tlv_free(node, node);
+}
+
+void tlv_node_destroy(tlv* tlv, tlvnode* node)
+{
+    if (!tlv || !node)
+    {
+        return;
+    }
+
+    if (tlv->index)
+    {
+        index_subtree(tlv, node, 0);
+    }
+
+    if (node->flags & NODE_FLAG_ARENA)
+    {
+        // released together with the arena in tlv_destroy
+        return;
+    }
+
+    STATS_TIME_BEGIN(start);
+    tlv_cursor c;
+
+    // postorder, children are freed before the node linking them
+    tlv_cursor_init(&c, tlv, node, TLV_CURSOR_POSTORDER | TLV_CURSOR_SHALLOW);
+    while (c.node)
+    {
+        tlvnode* curnode = c.node;
+
+        tlv_cursor_next(&c);
+        free_tlv_node(curnode);
+    }
+
+    STATS_TIME_END(tlv, destroyns, start);
+}
+
+void tlv_node_set_attributes(tlv* tlv, tlvnode* node, tlv_node_attr_t attr, int value)
+{
+    if (!tlv || !node || tlv_node_own_header(tlv, node))
+    {
+        return;
+    }
+
+    int index_t = attr / 8;
+    int index_byte = attr % 8;
+    tlvbyte b = 0x01;
+    b = b << (7 - index_byte);
+
+    if (value == 0)
+    {
+        b = ~b;
+        node->a[index_t] = node->a[index_t] & b;
+    }
+    else if (value == 1)
+    {
+
+        node->a[index_t] = node->a[index_t] | b;
+    }
+    else
+    {
+        // do nothing
+    }
+}
+
+int tlv_node_get_attributes(const tlv* tlv, const tlvnode* node, tlv_node_attr_t attr)
+{
+    if (!tlv || !node)
+    {
+        return 0;
+    }
+
+    int index_t = attr / 8;
+    int index_byte = attr % 8;
+
+    tlvbyte b = 0x01;
+    b = b << (7 - index_byte);
+
+    return (node->a[index_t]) & b;
+}
+
+int tlv_node_add_child(tlv* tlv, tlvnode* parent, tlvnode* child)
+{
+    if (!tlv || !parent || !child)
+    {
+        return -1;
+    }
+
+    if (tlv_node_materialize(tlv, parent) < 0)
+    {
+        // children of parent could not be decoded
+        return -1;
+    }
+
+    if (!tlv_node_get_attributes(tlv, parent, TLV_NODE_ATTR_IS_STRUCTUAL))
+    {
+        tlv_node_set_attributes(tlv, parent, TLV_NODE_ATTR_IS_STRUCTUAL, 1);
+    }
+
+    if (parent->v)
+    {
+        tlv_node_free_v(parent);
+        tlv_node_resize(tlv, parent, 0);
+    }
+
+    tlv_node_link_child(tlv, parent, child);
+
+    if (child->flags & NODE_FLAG_DIRTY)
+    {
+        // keep it reachable for tlv_layout
+        child->flags &= ~NODE_FLAG_DIRTY;
+        mark_dirty(child);
+    }
+
+    tlv_node_resize(tlv, parent, parent->length + node_dump_size(tlv, child));
+
+    return 0;
+}
+
+int tlv_node_remove_child(tlv* tlv, tlvnode* child)
+{
+    if (!tlv || !child)
+    {
+        return -1;
+    }
+
+    tlvnode* parent = child->parent;
+    if (!parent)
+    {
+        return -1;
+    }
+
+    tlv_node_resize(tlv, parent, parent->length - node_dump_size(tlv, child));
+
+    if (child->flags & NODE_FLAG_INDEXED)
+    {
+        index_subtree(tlv, child, 0);
+    }
+
+    if (child->flags & NODE_FLAG_DIRTY)
+    {
+        // stays dirty, together with its own dirty subtree
+        dirty_unlink(child);
+    }
+
+    // child->parent tells it is in the subling list, unlink in place
+    if (child->prevSubling)
+    {
+        child->prevSubling->nextSubling = child->nextSubling;
+    }
+    else
+    {
+        parent->firstChild = child->nextSubling;
+    }
+
+    if (child->nextSubling)
+    {
+        child->nextSubling->prevSubling = child->prevSubling;
+    }
+    else
+    {
+        parent->lastChild = child->prevSubling;
+    }
+
+    --(parent->childCount);
+    child->parent = child->prevSubling = child->nextSubling = NULL;
+
+    if (!parent->childCount)
+    {
+        tlv_node_set_attributes(tlv, parent, TLV_NODE_ATTR_IS_STRUCTUAL, 0);
+    }
+
+    return 0;
+}
+
+/*
+ * calculate all the *l, length values in tlv tree
+ * returns bytes of total dump size
+ */
+size_t tlv_layout(tlv* tlv)
+{
+    size_t dumplen = 0;
+    tlvnode* curnode;
+
+    if (!tlv || !tlv->root)
+    {
+        return 0;
+    }
+
+    // lengths are kept up to date by the node functions, only the
+    // l of dirty nodes is stale. walk down the dirty paths alone,
+    // popping each dirty list on the way, parents lead back up
+    STATS_TIME_BEGIN(start);
+    STATS_ADD(tlv, layouts, 1);
+    curnode = tlv->root;
+    if (curnode->flags & NODE_FLAG_DIRTY)
+    {
+        tlv_node_set_l(tlv, curnode, curnode->length);
+        curnode->flags &= ~NODE_FLAG_DIRTY;
+        STATS_ADD(tlv, layoutnodes, 1);
+
+        while (curnode)
+        {
+            tlvnode* child = curnode->dirtyFirst;
+            if (child)
+            {
+                dirty_unlink(child);
+                tlv_node_set_l(tlv, child, child->length);
+                child->flags &= ~NODE_FLAG_DIRTY;
+                STATS_ADD(tlv, layoutnodes, 1);
+                curnode = child;
+            }
+            else
+            {
+                curnode = curnode == tlv->root ? NULL : curnode->parent;
+            }
+        }
+    }
+
+    dumplen = node_dump_size(tlv, tlv->root);
+    tlv->dumplength = dumplen;
+    STATS_TIME_END(tlv, layoutns, start);
+
+    return dumplen;
+}
+
+size_t tlv_node_read_t(const tlv* tlv, const tlvnode* node, tlvbyte* buf, size_t bufsize)
+{
+    size_t size = 0;
+
+    if (!tlv || !node || !buf || bufsize < 0)
+    {
+        return -1;
+    }
+
+    if (tlv->tlength)
+    {
+        size = bufsize < tlv->tlength ? bufsize : tlv->tlength;
+        memcpy(buf, node->t, size);
+    }
+
+    return size;
+}
+
+size_t tlv_node_write_t(tlv* tlv, tlvnode* node, tlvbyte* tvalue, size_t tlength)
+{
+    size_t size;
+    size_t oldsize;
+
+    if (!tlv || !node || !tvalue || tlength < 0 || tlv_node_own_header(tlv, node))
+    {
+        return 0;
+    }
+
+    size = tlength < tlv->tlength? tlength : tlv->tlength;
+    oldsize = node_dump_size(tlv, node);
+
+    if (node->flags & NODE_FLAG_INDEXED)
+    {
+        // rehash under the new tag
+        index_remove(tlv, node);
+        memcpy(node->t, tvalue, size);
+        index_insert(tlv, node);
+    }
+    else
+    {
+        memcpy(node->t, tvalue, size);
+    }
+
+    // a varint tag takes as many bytes as it has
+    if ((tlv->varint & TLV_VARINT_T) && node_dump_size(tlv, node) != oldsize)
+    {
+        node_size_changed(tlv, node, oldsize);
+    }
+
+    return size;
+}
+
+/*
+ * append length of an LZ4 token field beyond its 4 bits
+ */
+static int lz_put_length(tlvbyte* dst, size_t dstsize, size_t* op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (*op >= dstsize)
+        {
+            return -1;
+        }
+
+        dst[(*op)++] = 255;
+    }
+
+    if (*op >= dstsize)
+    {
+        return -1;
+    }
+
+    dst[(*op)++] = (tlvbyte)length;
+
+    return 0;
+}
+
+/*
+ * append one LZ4 sequence: literals, then a match unless offset is 0
+ */
+static int lz_put_sequence(tlvbyte* dst, size_t dstsize, size_t* op,
+                           const tlvbyte* literals, size_t litlength, size_t offset, size_t matchlength)
+{
+    tlvbyte token = (tlvbyte)((litlength < 15 ? litlength : 15) << 4);
+
+    if (offset)
+    {
+        token |= matchlength < 15 ? matchlength : 15;
+    }
+
+    if (*op >= dstsize)
+    {
+        return -1;
+    }
+
+    dst[(*op)++] = token;
+
+    if (litlength >= 15 && lz_put_length(dst, dstsize, op, litlength - 15))
+    {
+        return -1;
+    }
+
+    if (litlength > dstsize - *op)
+    {
+        return -1;
+    }
+
+    memcpy(dst + *op, literals, litlength);
+    *op += litlength;
+
+    if (!offset)
+    {
+        return 0;
+    }
+
+    if (dstsize - *op < 2)
+    {
+        return -1;
+    }
+
+    dst[(*op)++] = (tlvbyte)offset;
+    dst[(*op)++] = (tlvbyte)(offset >> 8);
+
+    if (matchlength >= 15 && lz_put_length(dst, dstsize, op, matchlength - 15))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t lz_read32(const tlvbyte* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * compress src into an LZ4 block, greedy matching on a hash of 4 bytes
+ * returns: compressed length, 0 if it does not fit in dstsize
+ */
+static size_t lz_compress(const tlvbyte* src, size_t size, tlvbyte* dst, size_t dstsize)
+{
+    // too big for the stack, and only as much of it as size can
+    // fill is cleared, so small values do not pay for all of it
+    static __thread uint32_t table[1 << LZ_HASH_BITS];
+    unsigned int bits = LZ_HASH_BITS;
+    size_t anchor = 0;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (bits > 8 && ((size_t)1 << (bits - 1)) >= size)
+    {
+        bits--;
+    }
+
+    memset(table, 0, sizeof(uint32_t) << bits);
+
+    while (size > LZ_MFLIMIT && ip < size - LZ_MFLIMIT)
+    {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - bits);
+        size_t ref = table[h];
+
+        table[h] = (uint32_t)ip;
+
+        if (ref < ip && ip - ref <= LZ_MAX_OFFSET && lz_read32(src + ref) == seq)
+        {
+            size_t m = ip + LZ_MIN_MATCH;
+
+            // the last literals stay literals
+            while (m < size - LZ_LAST_LITERALS && src[m] == src[ref + m - ip])
+            {
+                m++;
+            }
+
+            if (lz_put_sequence(dst, dstsize, &op, src + anchor, ip - anchor,
+                                ip - ref, m - ip - LZ_MIN_MATCH))
+            {
+                return 0;
+            }
+
+            ip = anchor = m;
+        }
+        else
+        {
+            ip++;
+        }
+    }
+
+    if (lz_put_sequence(dst, dstsize, &op, src + anchor, size - anchor, 0, 0))
+    {
+        return 0;
+    }
+
+    return op;
+}
+
+/*
+ * decompress an LZ4 block, checking every length against both buffers
+ * returns: decompressed length, -1 if src is corrupt or dst too small
+ */
+static size_t lz_decompress(const tlvbyte* src, size_t size, tlvbyte* dst, size_t dstsize)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < size)
+    {
+        tlvbyte token = src[ip++];
+        size_t length = token >> 4;
+        size_t offset;
+        size_t i;
+
+        if (length == 15)
+        {
+            tlvbyte b;
+
+            do
+            {
+                if (ip >= size)
+                {
+                    return -1;
+                }
+
+                b = src[ip++];
+                length += b;
+            } while (b == 255);
+        }
+
+        if (length > size - ip || length > dstsize - op)
+        {
+            return -1;
+        }
+
+        memcpy(dst + op, src + ip, length);
+        ip += length;
+        op += length;
+
+        // the last sequence has literals only
+        if (ip == size)
+        {
+            break;
+        }
+
+        if (size - ip < 2)
+        {
+            return -1;
+        }
+
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > op)
+        {
+            return -1;
+        }
+
+        length = token & 0x0f;
+        if (length == 15)
+        {
+            tlvbyte b;
+
+            do
+            {
+                if (ip >= size)
+                {
+                    return -1;
+                }
+
+                b = src[ip++];
+                length += b;
+            } while (b == 255);
+        }
+
+        length += LZ_MIN_MATCH;
+        if (length > dstsize - op)
+        {
+            return -1;
+        }
+
+        // source and destination overlap for offset below length
+        for (i = 0; i < length; i++, op++)
+        {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op;
+}
+
+/*
+ * whether TLV_NODE_ATTR_IS_COMPRESSED of node means anything at all
+ */
+static int value_compressible(const tlv* t, const tlvnode* node)
+{
+    return t->compress
+        && t->alength > TLV_NODE_ATTR_IS_COMPRESSED / 8
+        && !tlv_node_get_attributes(t, node, TLV_NODE_ATTR_IS_STRUCTUAL);
+}
+
+static int value_compressed(const tlv* t, const tlvnode* node)
+{
+    return value_compressible(t, node)
+        && tlv_node_get_attributes(t, node, TLV_NODE_ATTR_IS_COMPRESSED)
+        && node->length >= LZ_HDR_SIZE;
+}
+
+/*
+ * compress vvalue into v, of vlength bytes, if tlv asks for it
+ * returns: compressed length with header, 0 if it is not worth it
+ */
+static size_t value_compress(const tlv* t, const tlvnode* node, const tlvbyte* vvalue, size_t vlength, tlvbyte* v)
+{
+    size_t size;
+
+    if (!v || !t->compressmin || vlength < t->compressmin || vlength > 0xffffffff
+            || vlength <= LZ_HDR_SIZE || !value_compressible(t, node))
+    {
+        return 0;
+    }
+
+    // only a value coming out smaller is kept
+    size = lz_compress(vvalue, vlength, v + LZ_HDR_SIZE, vlength - LZ_HDR_SIZE - 1);
+    if (!size)
+    {
+        return 0;
+    }
+
+    v[0] = (tlvbyte)vlength;
+    v[1] = (tlvbyte)(vlength >> 8);
+    v[2] = (tlvbyte)(vlength >> 16);
+    v[3] = (tlvbyte)(vlength >> 24);
+
+    return size + LZ_HDR_SIZE;
+}
+
+size_t tlv_node_write_v(tlv* tlv, tlvnode* node, tlvbyte* vvalue, size_t vlength)
+{
+    size_t i;
+    size_t length;
+
+    if (!tlv || !node || !vvalue || vlength < 0)
+    {
+        return 0;
+    }
+
+    tlv_node_free_v(node);
+
+    // sized for the value as it is, which is what a value that does
+    // not compress is copied into
+    node->v = (tlvbyte*)tlv_alloc(tlv, vlength);
+
+    length = value_compress(tlv, node, vvalue, vlength, node->v);
+    if (length)
+    {
+        tlv_node_set_attributes(tlv, node, TLV_NODE_ATTR_IS_COMPRESSED, 1);
+        tlv_node_resize(tlv, node, length);
+
+        return vlength;
+    }
+
+    if (value_compressible(tlv, node))
+    {
+        tlv_node_set_attributes(tlv, node, TLV_NODE_ATTR_IS_COMPRESSED, 0);
+    }
+
+    tlv_node_resize(tlv, node, vlength);
+
+    for (i = 0; i < vlength; i++)
+    {
+        node->v[i] = vvalue[i];
+    }
+
+    return vlength;
+}
+
+size_t tlv_node_value_length(const tlv* tlv, const tlvnode* node)
+{
+    size_t length;
+
+    if (!tlv || !node)
+    {
+        return 0;
+    }
+
+    if (!value_compressed(tlv, node))
+    {
+        return node->length;
+    }
+
+    length = node->v[0] | (node->v[1] << 8) | (node->v[2] << 16) | ((size_t)node->v[3] << 24);
+
+    // the header comes from the wire, no block of this size decodes to more
+    if (length > (node->length - LZ_HDR_SIZE) * LZ_MAX_RATIO + 16)
+    {
+        return -1;
+    }
+
+    return length;
+}
+
+size_t tlv_node_read_v(const tlv* tlv, const tlvnode* node, tlvbyte* buf, size_t bufsize)
+{
+    size_t length = tlv_node_value_length(tlv, node);
+
+    if (!tlv || !node || length == (size_t)-1 || (!buf && length > 0) || length > bufsize)
+    {
+        return -1;
+    }
+
+    if (!value_compressed(tlv, node))
+    {
+        if (length)
+        {
+            memcpy(buf, node->v, length);
+        }
+
+        return length;
+    }
+
+    if (lz_decompress(node->v + LZ_HDR_SIZE, node->length - LZ_HDR_SIZE, buf, length) != length)
+    {
+        return -1;
+    }
+
+    return length;
+}
+
+int tlv_node_decompress(tlv* tlv, tlvnode* node)
+{
+    size_t length;
+    tlvbyte* v;
+
+    if (!tlv || !node)
+    {
+        return -1;
+    }
+
+    if (!value_compressed(tlv, node))
+    {
+        return 0;
+    }
+
+    length = tlv_node_value_length(tlv, node);
+    if (length == (size_t)-1)
+    {
+        return -1;
+    }
+
+    v = (tlvbyte*)tlv_alloc(tlv, length);
+    if (!v || tlv_node_read_v(tlv, node, v, length) != length)
+    {
+        if (v)
+        {
+            tlv_free(node, v);
+        }
+
+        return -1;
+    }
+
+    tlv_node_free_v(node);
+    tlv_node_set_attributes(tlv, node, TLV_NODE_ATTR_IS_COMPRESSED, 0);
+    tlv_node_resize(tlv, node, length);
+    node->v = v;
+
+    return 0;
+}
+
+
+int tlv_node_traverse(tlv* t, int (*callback)(tlv*, tlvnode*))
+{
+    int visited = 0;
+    tlv_cursor c;
+
+    if (!t || !t->root)
+    {
+        return 0;
+    }
+
+    STATS_TIME_BEGIN(start);
+
+    // lazy nodes are materialized as the cursor steps into them
+    for (tlv_cursor_init(&c, t, t->root, TLV_CURSOR_PREORDER); c.node; tlv_cursor_next(&c))
+    {
+        ++visited;
+        STATS_MAX(t, peakdepth, c.depth + 1);
+
+        if (callback && callback(t, c.node))
+        {
+            break;
+        }
+    }
+
+    STATS_TIME_END(t, traversens, start);
+    return visited;
+}
+
+
+
+
+tlv_flat* tlv_flat_obtain(tlv* tlv)
+{
+    tlv_flat* flat;
+
+    if (!tlv || tlv->varint)
+    {
+        return NULL;
+    }
+
+    flat = (tlv_flat*)malloc(sizeof(tlv_flat));
+    if (!flat)
+    {
+        return NULL;
+    }
+
+    memset(flat, 0x00, sizeof(tlv_flat));
+    flat->tlv = tlv;
+
+    return flat;
+}
+
+void tlv_flat_destroy(tlv_flat* flat)
+{
+    if (!flat)
+    {
+        return;
+    }
+
+    free(flat->h);
+    free(flat->v);
+    free(flat->length);
+    free(flat->next);
+    free(flat->parent);
+    free(flat->data);
+    free(flat);
+}
+
+/*
+ * make room for at least capacity nodes
+ * returns: 0 if succeed
+ */
+static int flat_reserve(tlv_flat* flat, size_t capacity)
+{
+    void* p;
+
+    if (capacity <= flat->capacity)
+    {
+        return 0;
+    }
+
+    if (capacity < flat->capacity * 2)
+    {
+        capacity = flat->capacity * 2;
+    }
+
+    if (!(p = realloc(flat->h, sizeof(tlvbyte*) * capacity)))
+    {
+        return -1;
+    }
+    flat->h = (tlvbyte**)p;
+
+    if (!(p = realloc(flat->v, sizeof(tlvbyte*) * capacity)))
+    {
+        return -1;
+    }
+    flat->v = (tlvbyte**)p;
+
+    if (!(p = realloc(flat->length, sizeof(size_t) * capacity)))
+    {
+        return -1;
+    }
+    flat->length = (size_t*)p;
+
+    if (!(p = realloc(flat->next, sizeof(size_t) * capacity)))
+    {
+        return -1;
+    }
+    flat->next = (size_t*)p;
+
+    if (!(p = realloc(flat->parent, sizeof(size_t) * capacity)))
+    {
+        return -1;
+    }
+    flat->parent = (size_t*)p;
+
+    flat->capacity = capacity;
+
+    return 0;
+}
+
+size_t tlv_flat_loads(tlv_flat* flat, tlvbyte* bytes, size_t size)
+{
+    size_t index = 0;
+    size_t end;
+    size_t hdrsize;
+    size_t open = TLV_FLAT_NONE; // innermost constructed node not closed yet
+    const tlv* t;
+    const tlv_codec* codec;
+
+    if (!flat || !bytes || size <= 0)
+    {
+        return 0;
+    }
+
+    t = flat->tlv;
+    codec = tlv_codec_of(flat->tlv);
+    hdrsize = t->alength + t->tlength + t->llength;
+    flat->count = 0;
+
+    // a guess from the smallest node, grown on demand
+    if (flat_reserve(flat, size / hdrsize / 4 + 1))
+    {
+        return 0;
+    }
+
+    do
+    {
+        size_t i = flat->count;
+
+        if (hdrsize > size - index)
+        {
+            return 0;
+        }
+
+        if (i == flat->capacity && flat_reserve(flat, i + 1))
+        {
+            return 0;
+        }
+
+        flat->h[i] = bytes + index;
+        flat->length[i] = codec->get_length(t, bytes + index + t->alength + t->tlength);
+        flat->parent[i] = open;
+        index += hdrsize;
+
+        end = open == TLV_FLAT_NONE ? size : (size_t)(flat->h[open] - bytes)
+                + hdrsize + flat->length[open];
+        if (index > end || flat->length[i] > end - index)
+        {
+            // overruns its parent or the bytes
+            return 0;
+        }
+
+        flat->count++;
+
+        if (attr_bit(flat->h[i], TLV_NODE_ATTR_IS_STRUCTUAL) && flat->length[i] > 0)
+        {
+            flat->v[i] = NULL;
+            open = i;
+            continue;
+        }
+
+        flat->v[i] = attr_bit(flat->h[i], TLV_NODE_ATTR_IS_STRUCTUAL) ? NULL : bytes + index;
+        flat->next[i] = flat->count;
+        index += flat->length[i];
+
+        // close every constructed node ending here, parents are the stack
+        while (open != TLV_FLAT_NONE
+                && (size_t)(flat->h[open] - bytes) + hdrsize + flat->length[open] == index)
+        {
+            flat->next[open] = flat->count;
+            open = flat->parent[open];
+        }
+    } while (open != TLV_FLAT_NONE);
+
+    return index;
+}
+
+int tlv_flat_from_tree(tlv_flat* flat, tlv* tlv)
+{
+    size_t size;
+    tlvbyte* data;
+
+    if (!flat || !tlv || !tlv->root)
+    {
+        return -1;
+    }
+
+    size = tlv_layout(tlv);
+    data = (tlvbyte*)malloc(size);
+    if (!data)
+    {
+        return -1;
+    }
+
+    flat->tlv = tlv;
+    if (tlv_dumps(tlv, data, size) != size || tlv_flat_loads(flat, data, size) != size)
+    {
+        free(data);
+        return -1;
+    }
+
+    free(flat->data);
+    flat->data = data;
+
+    return 0;
+}
+
+int tlv_flat_is_structual(const tlv_flat* flat, size_t index)
+{
+    if (!flat || index >= flat->count)
+    {
+        return 0;
+    }
+
+    return attr_bit(flat->h[index], TLV_NODE_ATTR_IS_STRUCTUAL);
+}
+
+int tlv_flat_write_v(tlv_flat* flat, size_t index, tlvbyte* vvalue, size_t vlength)
+{
+    if (!flat || index >= flat->count || tlv_flat_is_structual(flat, index))
+    {
+        return -1;
+    }
+
+    flat->v[index] = vvalue;
+    flat->length[index] = vlength;
+
+    return 0;
+}
+
+size_t tlv_flat_layout(tlv_flat* flat)
+{
+    size_t i;
+    size_t hdrsize;
+
+    if (!flat || !flat->count)
+    {
+        return 0;
+    }
+
+    hdrsize = flat->tlv->alength + flat->tlv->tlength + flat->tlv->llength;
+
+    // children come after their parent, so reversed preorder is bottom up
+    for (i = flat->count; i-- > 0; )
+    {
+        size_t c;
+
+        if (!flat->v[i] && flat->next[i] > i + 1)
+        {
+            flat->length[i] = 0;
+            for (c = i + 1; c < flat->next[i]; c = flat->next[c])
+            {
+                flat->length[i] += hdrsize + flat->length[c];
+            }
+        }
+    }
+
+    return hdrsize + flat->length[0];
+}
+
+size_t tlv_flat_dumps(tlv_flat* flat, tlvbyte* buf, size_t bufsize)
+{
+    size_t i;
+    size_t index = 0;
+    size_t atsize;
+    const tlv* t;
+    const tlv_codec* codec;
+
+    if (!flat || !buf || !flat->count)
+    {
+        return 0;
+    }
+
+    t = flat->tlv;
+    codec = tlv_codec_of(flat->tlv);
+    atsize = t->alength + t->tlength;
+
+    // preorder is dump order, one sweep over the arrays.
+    // lengths may be stale after tlv_flat_write_v, so every node is checked
+    for (i = 0; i < flat->count; i++)
+    {
+        size_t vlength = flat->v[i] ? flat->length[i] : 0;
+
+        if (atsize + t->llength + vlength > bufsize - index)
+        {
+            return 0;
+        }
+
+        memcpy(buf + index, flat->h[i], atsize);
+        index += atsize;
+        codec->put_length(t, buf + index, flat->length[i]);
+        index += t->llength;
+
+        if (flat->v[i])
+        {
+            memcpy(buf + index, flat->v[i], vlength);
+            index += vlength;
+        }
+    }
+
+    return index;
+}
+
+int tlv_flat_traverse(tlv_flat* flat, int (*callback)(tlv_flat*, size_t))
+{
+    size_t i;
+
+    if (!flat)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < flat->count; i++)
+    {
+        if (callback && callback(flat, i))
+        {
+            return i + 1;
+        }
+    }
+
+    return flat->count;
+}
+
+
+void tlv_builder_init(tlv_builder* b, const tlv* tlv, tlvbyte* buf, size_t bufsize)
+{
+    if (!b)
+    {
+        return;
+    }
+
+    b->tlv = tlv;
+    b->codec = tlv ? codec_lookup(tlv) : NULL;
+    b->buf = buf;
+    b->bufsize = bufsize;
+    b->index = 0;
+    b->depth = 0;
+    b->error = !tlv || tlv->varint || !buf;
+}
+
+/*
+ * returns: the biggest length l bytes of tlv can hold
+ */
+static size_t max_length(const tlv* t)
+{
+    if (t->llength >= sizeof(size_t))
+    {
+        return (size_t)-1;
+    }
+
+    return ((size_t)1 << (8 * t->llength)) - 1;
+}
+
+/*
+ * write a, t of a node header, l is left for the caller
+ * returns: 0 if succeed
+ */
+static int builder_put_header(tlv_builder* b, int structual,
+                              const tlvbyte* tvalue, size_t tlength)
+{
+    const tlv* t = b->tlv;
+    size_t hdrsize;
+    tlvbyte* hdr;
+
+    if (b->error)
+    {
+        return -1;
+    }
+
+    hdrsize = t->alength + t->tlength + t->llength;
+    if (hdrsize > b->bufsize - b->index)
+    {
+        b->error = 1;
+        return -1;
+    }
+
+    hdr = b->buf + b->index;
+    memset(hdr, 0x00, hdrsize);
+    if (structual)
+    {
+        hdr[TLV_NODE_ATTR_IS_STRUCTUAL / 8] |= attr_mask(TLV_NODE_ATTR_IS_STRUCTUAL);
+    }
+
+    if (tvalue)
+    {
+        memcpy(hdr + t->alength, tvalue, tlength < t->tlength ? tlength : t->tlength);
+    }
+
+    b->index += hdrsize;
+
+    return 0;
+}
+
+int tlv_builder_begin(tlv_builder* b, const tlvbyte* tvalue, size_t tlength)
+{
+    if (!b)
+    {
+        return -1;
+    }
+
+    if (b->depth == TLV_BUILDER_MAX_DEPTH)
+    {
+        b->error = 1;
+        return -1;
+    }
+
+    size_t hdrindex = b->index;
+    if (builder_put_header(b, 1, tvalue, tlength))
+    {
+        return -1;
+    }
+
+    b->open[b->depth++] = hdrindex;
+
+    return 0;
+}
+
+int tlv_builder_value(tlv_builder* b, const tlvbyte* tvalue, size_t tlength,
+                      const tlvbyte* vvalue, size_t vlength)
+{
+    const tlv* t;
+
+    if (!b || (!vvalue && vlength > 0))
+    {
+        return -1;
+    }
+
+    t = b->tlv;
+    if (builder_put_header(b, 0, tvalue, tlength))
+    {
+        return -1;
+    }
+
+    if (vlength > max_length(t) || vlength > b->bufsize - b->index)
+    {
+        b->error = 1;
+        return -1;
+    }
+
+    b->codec->put_length(t, b->buf + b->index - t->llength, vlength);
+    if (vlength)
+    {
+        memcpy(b->buf + b->index, vvalue, vlength);
+        b->index += vlength;
+    }
+
+    return 0;
+}
+
+int tlv_builder_end(tlv_builder* b)
+{
+    const tlv* t;
+    size_t hdrindex;
+    size_t hdrsize;
+    size_t length;
+
+    if (!b || b->error || !b->depth)
+    {
+        return -1;
+    }
+
+    t = b->tlv;
+    hdrsize = t->alength + t->tlength + t->llength;
+    hdrindex = b->open[--b->depth];
+
+    // everything written since the header is content of this node
+    length = b->index - hdrindex - hdrsize;
+    if (length > max_length(t))
+    {
+        b->error = 1;
+        return -1;
+    }
+
+    b->codec->put_length(t, b->buf + hdrindex + t->alength + t->tlength, length);
+
+    return 0;
+}
+
+size_t tlv_builder_finish(tlv_builder* b)
+{
+    if (!b || b->error || b->depth)
+    {
+        return 0;
+    }
+
+    return b->index;
+}
+
+
+struct tlv_batch
+{
+    const tlv* tlv; // definition for every message
+    struct tlv_arena* arena; // backs the nodes of all trees
+    _stack* stack; // nesting scratch for every load
+    tlv** trees; // kept across loads, first count of them in use
+    size_t count;
+    size_t capacity;
+};
+
+tlv_batch* tlv_batch_obtain(const tlv* tlv, size_t chunksize)
+{
+    tlv_batch* batch;
+
+    if (!tlv || tlv->varint)
+    {
+        return NULL;
+    }
+
+    batch = (tlv_batch*)malloc(sizeof(tlv_batch));
+    if (!batch)
+    {
+        return NULL;
+    }
+
+    batch->tlv = tlv;
+    batch->arena = arena_obtain(chunksize);
+    batch->stack = stack_obtain(STACK_INIT_SIZE);
+    batch->trees = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+
+    if (!batch->arena || !batch->stack)
+    {
+        tlv_batch_destroy(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+/*
+ * forget trees of the last load, their nodes go with one arena reset
+ */
+static void batch_reset(tlv_batch* batch)
+{
+    size_t i;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        tlv* t = batch->trees[i];
+
+        if (t->index)
+        {
+            index_destroy(t->index);
+            t->index = NULL;
+        }
+
+        t->root = NULL;
+        t->dumplength = 0;
+    }
+
+    batch->count = 0;
+    arena_reset(batch->arena);
+}
+
+void tlv_batch_destroy(tlv_batch* batch)
+{
+    size_t i;
+
+    if (!batch)
+    {
+        return;
+    }
+
+    for (i = 0; i < batch->capacity; i++)
+    {
+        // nodes belong to the shared arena, not to the tree
+        batch->trees[i]->root = NULL;
+        batch->trees[i]->arena = NULL;
+        tlv_destroy(batch->trees[i]);
+    }
+
+    free(batch->trees);
+    stack_destroy(batch->stack);
+    arena_destroy(batch->arena);
+    free(batch);
+}
+
+/*
+ * next unused tree of batch, set up for the definition
+ */
+static tlv* batch_next_tree(tlv_batch* batch)
+{
+    tlv* t;
+
+    if (batch->count == batch->capacity)
+    {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 16;
+        tlv** trees = (tlv**)realloc(batch->trees, sizeof(tlv*) * capacity);
+        if (!trees)
+        {
+            return NULL;
+        }
+
+        batch->trees = trees;
+        while (batch->capacity < capacity)
+        {
+            t = tlv_obtain();
+            if (!t)
+            {
+                return NULL;
+            }
+
+            t->arena = batch->arena;
+            batch->trees[batch->capacity++] = t;
+        }
+    }
+
+    t = batch->trees[batch->count];
+    t->alength = batch->tlv->alength;
+    t->tlength = batch->tlv->tlength;
+    t->llength = batch->tlv->llength;
+    t->byteprio = batch->tlv->byteprio;
+    t->loadmode = batch->tlv->loadmode;
+    t->compress = batch->tlv->compress;
+
+    return t;
+}
+
+size_t tlv_batch_loads(tlv_batch* batch, tlvbyte* bytes, size_t size, int* malformed)
+{
+    const tlv* def;
+    const tlv_codec* codec;
+    size_t hdrsize;
+    size_t consumed = 0;
+
+    if (malformed)
+    {
+        *malformed = 0;
+    }
+
+    if (!batch)
+    {
+        return 0;
+    }
+
+    batch_reset(batch);
+
+    if (!bytes)
+    {
+        return 0;
+    }
+
+    def = batch->tlv;
+    codec = codec_lookup(def);
+    hdrsize = def->alength + def->tlength + def->llength;
+
+    while (size - consumed >= hdrsize)
+    {
+        size_t length = codec->get_length(def, bytes + consumed + def->alength + def->tlength);
+        size_t msgsize;
+        size_t handled;
+        tlv* t;
+
+        if (length > size - consumed - hdrsize)
+        {
+            // trailing partial message, left for the next load
+            break;
+        }
+
+        msgsize = hdrsize + length;
+
+        t = batch_next_tree(batch);
+        if (!t)
+        {
+            break;
+        }
+
+        if (t->loadmode == TLV_LOAD_LAZY)
+        {
+            handled = tlv_loads_lazy(t, bytes + consumed, msgsize);
+        }
+        else
+        {
+            handled = loads_tree(t, bytes + consumed, msgsize, batch->stack);
+        }
+
+        if (handled != msgsize)
+        {
+            t->root = NULL;
+            if (malformed)
+            {
+                *malformed = 1;
+            }
+            break;
+        }
+
+        batch->count++;
+        consumed += msgsize;
+    }
+
+    return consumed;
+}
+
+size_t tlv_batch_count(const tlv_batch* batch)
+{
+    return batch ? batch->count : 0;
+}
+
+tlv* tlv_batch_tree(tlv_batch* batch, size_t i)
+{
+    if (!batch || i >= batch->count)
+    {
+        return NULL;
+    }
+
+    return batch->trees[i];
+}
+
+
+typedef struct
+{
+    struct tlv_pool* pool;
+    size_t worker;
+} pool_worker;
+
+struct tlv_pool
+{
+    size_t threadcount; // workers, the calling thread included
+    pthread_t* threads;
+    pool_worker* workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation; // bumped for every job
+    size_t running; // threads still in the current job
+    int quit;
+
+    void (*run)(void* job, size_t worker);
+    void* job;
+};
+
+static void* pool_thread(void* arg)
+{
+    pool_worker* w = (pool_worker*)arg;
+    tlv_pool* pool = w->pool;
+    unsigned long seen = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->quit)
+        {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+
+        if (pool->quit)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->run(pool->job, w->worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+tlv_pool* tlv_pool_obtain(size_t threadcount)
+{
+    tlv_pool* pool;
+    size_t i;
+
+    if (threadcount == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threadcount = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    pool = (tlv_pool*)malloc(sizeof(tlv_pool));
+    if (!pool)
+    {
+        return NULL;
+    }
+
+    pool->threadcount = 1;
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * threadcount);
+    pool->workers = (pool_worker*)malloc(sizeof(pool_worker) * threadcount);
+    pool->generation = 0;
+    pool->running = 0;
+    pool->quit = 0;
+    pool->run = NULL;
+    pool->job = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    if (!pool->threads || !pool->workers)
+    {
+        tlv_pool_destroy(pool);
+        return NULL;
+    }
+
+    // worker 0 is whoever calls into the pool
+    pool->workers[0].pool = pool;
+    pool->workers[0].worker = 0;
+
+    for (i = 1; i < threadcount; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].worker = i;
+
+        if (pthread_create(&pool->threads[i], NULL, pool_thread, &pool->workers[i]))
+        {
+            break;
+        }
+
+        pool->threadcount++;
+    }
+
+    return pool;
+}
+
+void tlv_pool_destroy(tlv_pool* pool)
+{
+    size_t i;
+
+    if (!pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 1; i < pool->threadcount; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ * run job on every worker of pool, returns when all of them finished
+ */
+static void pool_run(tlv_pool* pool, void (*run)(void* job, size_t worker), void* job)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->run = run;
+    pool->job = job;
+    pool->running = pool->threadcount - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    run(job, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * tasks [next, end) owned by one worker. it takes them from the front,
+ * thieves split off the back half.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} task_range;
+
+static task_range* ranges_obtain(size_t workers, size_t taskcount)
+{
+    task_range* ranges = (task_range*)malloc(sizeof(task_range) * workers);
+    size_t i;
+
+    if (!ranges)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&ranges[i].lock, NULL);
+        ranges[i].next = taskcount * i / workers;
+        ranges[i].end = taskcount * (i + 1) / workers;
+    }
+
+    return ranges;
+}
+
+static void ranges_destroy(task_range* ranges, size_t workers)
+{
+    size_t i;
+
+    for (i = 0; i < workers; i++)
+    {
+        pthread_mutex_destroy(&ranges[i].lock);
+    }
+
+    free(ranges);
+}
+
+/*
+ * next task for worker w, stolen from another worker when w ran dry
+ * returns: 0 if task was set, -1 once no task is left anywhere
+ */
+static int task_take(task_range* ranges, size_t workers, size_t w, size_t* task)
+{
+    size_t i;
+
+    pthread_mutex_lock(&ranges[w].lock);
+    if (ranges[w].next < ranges[w].end)
+    {
+        *task = ranges[w].next++;
+        pthread_mutex_unlock(&ranges[w].lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&ranges[w].lock);
+
+    for (i = 1; i < workers; i++)
+    {
+        task_range* victim = &ranges[(w + i) % workers];
+        size_t next;
+        size_t end;
+
+        pthread_mutex_lock(&victim->lock);
+        next = victim->next;
+        end = victim->end;
+        if (next < end)
+        {
+            next += (end - next) / 2;
+            victim->end = next;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (next < end)
+        {
+            pthread_mutex_lock(&ranges[w].lock);
+            ranges[w].next = next + 1;
+            ranges[w].end = end;
+            pthread_mutex_unlock(&ranges[w].lock);
+
+            *task = next;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+typedef struct
+{
+    const tlv* tlv; // definition
+    tlvbyte* bytes;
+    const size_t* offsets; // message i is [offsets[i], offsets[i + 1])
+    tlv** trees;
+    tlvbyte* malformed; // set for message i if its bytes failed to decode
+    task_range* ranges;
+    size_t workers;
+} loads_job;
+
+static void loads_job_run(void* arg, size_t w)
+{
+    loads_job* job = (loads_job*)arg;
+    _stack* lstack = stack_obtain(STACK_INIT_SIZE);
+    size_t i;
+
+    while (task_take(job->ranges, job->workers, w, &i) == 0)
+    {
+        size_t msgsize = job->offsets[i + 1] - job->offsets[i];
+        size_t handled = 0;
+        tlv* t = tlv_obtain();
+
+        if (t)
+        {
+            t->alength = job->tlv->alength;
+            t->tlength = job->tlv->tlength;
+            t->llength = job->tlv->llength;
+            t->byteprio = job->tlv->byteprio;
+            t->loadmode = job->tlv->loadmode;
+            t->compress = job->tlv->compress;
+
+            if (job->tlv->arena)
+            {
+                tlv_use_arena(t, job->tlv->arena->chunksize);
+            }
+
+            if (t->loadmode == TLV_LOAD_LAZY)
+            {
+                handled = tlv_loads_lazy(t, job->bytes + job->offsets[i], msgsize);
+            }
+            else if (lstack)
+            {
+                handled = loads_tree(t, job->bytes + job->offsets[i], msgsize, lstack);
+            }
+
+            if (handled != msgsize)
+            {
+                // with no lstack nothing was decoded, it ran out of memory
+                job->malformed[i] = t->loadmode == TLV_LOAD_LAZY || lstack;
+                tlv_destroy(t);
+                t = NULL;
+            }
+        }
+
+        job->trees[i] = t;
+    }
+
+    stack_destroy(lstack);
+}
+
+size_t tlv_parallel_loads(tlv_pool* pool, const tlv* def, tlvbyte* bytes, size_t size,
+                          tlv** trees, size_t treesize, size_t* count, int* malformed)
+{
+    const tlv_codec* codec;
+    size_t hdrsize;
+    size_t* offsets;
+    size_t n = 0;
+    size_t consumed = 0;
+    size_t good;
+    size_t i;
+    loads_job job;
+
+    if (count)
+    {
+        *count = 0;
+    }
+
+    if (malformed)
+    {
+        *malformed = 0;
+    }
+
+    if (!pool || !def || def->varint || !bytes || !trees || treesize == 0)
+    {
+        return 0;
+    }
+
+    codec = codec_lookup(def);
+    hdrsize = def->alength + def->tlength + def->llength;
+
+    offsets = (size_t*)malloc(sizeof(size_t) * (treesize + 1));
+    if (!offsets)
+    {
+        return 0;
+    }
+
+    // messages are found by their root l alone, nothing inside is read
+    offsets[0] = 0;
+    while (n < treesize && size - consumed >= hdrsize)
+    {
+        size_t length = codec->get_length(def, bytes + consumed + def->alength + def->tlength);
+        if (length > size - consumed - hdrsize)
+        {
+            break;
+        }
+
+        consumed += hdrsize + length;
+        offsets[++n] = consumed;
+    }
+
+    if (n > 0)
+    {
+        job.tlv = def;
+        job.bytes = bytes;
+        job.offsets = offsets;
+        job.trees = trees;
+        job.malformed = (tlvbyte*)calloc(n, 1);
+        job.workers = pool->threadcount;
+        job.ranges = job.malformed ? ranges_obtain(job.workers, n) : NULL;
+
+        if (!job.ranges)
+        {
+            free(job.malformed);
+            free(offsets);
+            return 0;
+        }
+
+        pool_run(pool, loads_job_run, &job);
+        ranges_destroy(job.ranges, job.workers);
+
+        // keep the trees before the first message that failed only
+        for (good = 0; good < n && trees[good]; good++);
+        for (i = good; i < n; i++)
+        {
+            tlv_destroy(trees[i]);
+            trees[i] = NULL;
+        }
+
+        consumed = offsets[good];
+        if (count)
+        {
+            *count = good;
+        }
+
+        if (malformed && good < n)
+        {
+            *malformed = job.malformed[good];
+        }
+
+        free(job.malformed);
+    }
+
+    free(offsets);
+    return consumed;
+}
+
+/*
+ * one child under a node the caller decoded itself: either decoded
+ * by the caller too (a spine node, split further) or by a worker
+ */
+typedef struct
+{
+    tlvnode* parent;
+    tlvnode* node; // the child, filled in by a worker for a task
+    tlvbyte* bytes; // header of the child
+    size_t size; // header and value of the child
+    size_t handled; // bytes a worker decoded for a task
+    int task;
+} tree_slot;
+
+typedef struct
+{
+    tlv* tlv;
+    tree_slot* slots;
+    size_t* tasks; // slot of every task
+    struct tlv_arena** arenas; // one per worker when tlv uses an arena
+    task_range* ranges;
+    size_t workers;
+} tree_job;
+
+static void tree_job_run(void* arg, size_t w)
+{
+    tree_job* job = (tree_job*)arg;
+    _stack* lstack = stack_obtain(STACK_INIT_SIZE);
+    size_t i;
+
+    worker_arena = job->arenas ? job->arenas[w] : NULL;
+
+    while (task_take(job->ranges, job->workers, w, &i) == 0)
+    {
+        tree_slot* slot = &job->slots[job->tasks[i]];
+
+        if (lstack)
+        {
+            slot->handled = loads_nodes(job->tlv, slot->bytes, slot->size, lstack, &slot->node);
+        }
+    }
+
+    worker_arena = NULL;
+    stack_destroy(lstack);
+}
+
+/*
+ * decode the header at bytes into a constructed node of the spine,
+ * children are left to the caller
+ */
+static tlvnode* spine_node(tlv* t, const tlv_codec* codec, tlvbyte* bytes)
+{
+    int view = t->loadmode == TLV_LOAD_VIEW;
+    tlvnode* node = node_alloc(t, !view);
+
+    if (!node)
+    {
+        return NULL;
+    }
+
+    if (view)
+    {
+        node->a = bytes;
+        node->t = node->a + t->alength;
+        node->l = node->t + t->tlength;
+        node->flags |= NODE_FLAG_VIEW_HDR;
+    }
+    else
+    {
+        codec->read_header(t, node->a, bytes);
+        STATS_ADD(t, loadbytes, t->alength + t->tlength + t->llength);
+    }
+
+    node->length = codec->get_length(t, node->l);
+
+    return node;
+}
+
+/*
+ * split the tree at bytes into slots: subtrees larger than grain
+ * become spine nodes, which are split in turn, breadth first.
+ * *count gets the slots made, also when failed
+ * returns: 0 if succeed, -1 if bytes are malformed
+ */
+static int tree_split(tlv* t, const tlv_codec* codec, tlvnode* root, tlvbyte* content,
+                      size_t grain, tree_slot** slots, size_t* count)
+{
+    size_t hdrsize = t->alength + t->tlength + t->llength;
+    size_t capacity = 0;
+    size_t cur;
+    tlvnode* parent = root;
+    tlvbyte* p = content;
+    tlvbyte* end = content + root->length;
+
+    for (cur = 0; ; cur++)
+    {
+        // children of parent, which are all in [p, end)
+        while (p < end)
+        {
+            tree_slot* slot;
+            size_t length;
+
+            if ((size_t)(end - p) < hdrsize)
+            {
+                return -1;
+            }
+
+            length = codec->get_length(t, p + t->alength + t->tlength);
+            if (length > (size_t)(end - p) - hdrsize)
+            {
+                return -1;
+            }
+
+            if (*count == capacity)
+            {
+                tree_slot* grown;
+
+                capacity = capacity ? capacity * 2 : 64;
+                grown = (tree_slot*)realloc(*slots, sizeof(tree_slot) * capacity);
+                if (!grown)
+                {
+                    return -1;
+                }
+                *slots = grown;
+            }
+
+            slot = &(*slots)[(*count)++];
+            slot->parent = parent;
+            slot->node = NULL;
+            slot->bytes = p;
+            slot->size = hdrsize + length;
+            slot->handled = 0;
+            slot->task = hdrsize + length <= grain
+                      || !attr_bit(p, TLV_NODE_ATTR_IS_STRUCTUAL);
+
+            p += hdrsize + length;
+        }
+
+        // next spine node in the order they were found
+        while (cur < *count && (*slots)[cur].task)
+        {
+            cur++;
+        }
+
+        if (cur == *count)
+        {
+            break;
+        }
+
+        parent = spine_node(t, codec, (*slots)[cur].bytes);
+        if (!parent)
+        {
+            return -1;
+        }
+
+        (*slots)[cur].node = parent;
+        p = (*slots)[cur].bytes + hdrsize;
+        end = p + parent->length;
+    }
+
+    return 0;
+}
+
+size_t tlv_parallel_loads_tree(tlv_pool* pool, tlv* t, tlvbyte* bytes, size_t size)
+{
+    const tlv_codec* codec;
+    size_t hdrsize;
+    size_t grain;
+    size_t slotcount = 0;
+    size_t taskcount = 0;
+    size_t i;
+    size_t handled = 0;
+    int arenasok = 0; // every worker got an arena of its own
+    tlvnode* root;
+    tree_slot* slots = NULL;
+    tree_job job;
+
+    if (!pool || !t || !bytes)
+    {
+        return 0;
+    }
+
+    codec = tlv_codec_of(t);
+    hdrsize = t->alength + t->tlength + t->llength;
+    grain = size / (pool->threadcount * PARALLEL_TASKS_PER_WORKER);
+    grain = grain > PARALLEL_MIN_GRAIN ? grain : PARALLEL_MIN_GRAIN;
+
+    if (pool->threadcount == 1 || t->loadmode == TLV_LOAD_LAZY || t->varint || size <= grain
+        || size < hdrsize || !attr_bit(bytes, TLV_NODE_ATTR_IS_STRUCTUAL))
+    {
+        return tlv_loads(t, bytes, size);
+    }
+
+    root = spine_node(t, codec, bytes);
+    if (!root)
+    {
+        return 0;
+    }
+
+    if (root->length > size - hdrsize)
+    {
+        tlv_node_destroy(t, root);
+        return 0;
+    }
+
+    if (tree_split(t, codec, root, bytes + hdrsize, grain, &slots, &slotcount) == 0)
+    {
+        handled = hdrsize + root->length;
+    }
+
+    job.tlv = t;
+    job.slots = slots;
+    job.workers = pool->threadcount;
+    job.tasks = (size_t*)malloc(sizeof(size_t) * (slotcount + 1));
+    job.arenas = NULL;
+    job.ranges = NULL;
+
+    if (job.tasks)
+    {
+        for (i = 0; i < slotcount; i++)
+        {
+            if (slots[i].task)
+            {
+                job.tasks[taskcount++] = i;
+            }
+        }
+
+        job.ranges = ranges_obtain(job.workers, taskcount);
+    }
+
+    if (t->arena && job.ranges)
+    {
+        job.arenas = (struct tlv_arena**)calloc(job.workers, sizeof(struct tlv_arena*));
+        arenasok = job.arenas != NULL;
+        for (i = 0; arenasok && i < job.workers; i++)
+        {
+            job.arenas[i] = arena_obtain(t->arena->chunksize);
+            arenasok = job.arenas[i] != NULL;
+        }
+    }
+
+    if (handled && job.ranges && (!t->arena || arenasok))
+    {
+        pool_run(pool, tree_job_run, &job);
+    }
+    else
+    {
+        handled = 0;
+    }
+
+    // link everything in slot order, malformed parts too, so that
+    // the tlv owns all nodes made
+    for (i = 0; i < slotcount; i++)
+    {
+        if (slots[i].task && slots[i].handled != slots[i].size)
+        {
+            handled = 0;
+        }
+
+        if (slots[i].node)
+        {
+            tlv_node_link_child(t, slots[i].parent, slots[i].node);
+        }
+    }
+
+    if (job.arenas)
+    {
+        for (i = 0; i < job.workers; i++)
+        {
+            if (job.arenas[i])
+            {
+                arena_adopt(t->arena, job.arenas[i]);
+                arena_destroy(job.arenas[i]);
+            }
+        }
+        free(job.arenas);
+    }
+
+    if (job.ranges)
+    {
+        ranges_destroy(job.ranges, job.workers);
+    }
+
+    free(job.tasks);
+    free(slots);
+
+    t->root = root;
+    index_reset(t);
+
+    return handled;
+}
+
+/*
+ * one subtree of the output, at its offset from the prefix sum over
+ * its elder sublings
+ */
+typedef struct
+{
+    tlvnode* node;
+    size_t offset;
+    size_t end; // index after the subtree, once a worker dumped it
+    int task;
+} dump_slot;
+
+typedef struct
+{
+    tlv* tlv;
+    const tlv_codec* codec;
+    dump_slot* slots;
+    size_t* tasks; // slot of every task
+    tlvbyte* buf;
+    size_t bufsize;
+    task_range* ranges;
+    size_t workers;
+} dump_job;
+
+static void dump_job_run(void* arg, size_t w)
+{
+    dump_job* job = (dump_job*)arg;
+    size_t i;
+
+    while (task_take(job->ranges, job->workers, w, &i) == 0)
+    {
+        dump_slot* slot = &job->slots[job->tasks[i]];
+
+        slot->end = dumps_subtree(job->tlv, job->codec, slot->node,
+                                  job->buf, job->bufsize, slot->offset);
+    }
+}
+
+/*
+ * write headers of the spine, subtrees larger than grain, breadth
+ * first from root, and give every child of them its offset.
+ * children no larger than grain become tasks.
+ * returns: slot count, -1 if failed
+ */
+static size_t dump_split(tlv* t, const tlv_codec* codec, tlvbyte* buf,
+                         size_t grain, dump_slot** slots)
+{
+    size_t hdrsize = t->alength + t->tlength + t->llength;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t cur;
+    tlvnode* parent = t->root;
+    size_t offset = 0;
+
+    for (cur = 0; ; cur++)
+    {
+        tlvnode* child;
+
+        codec->write_header(t, buf + offset, parent);
+        offset += hdrsize;
+
+        for (child = parent->firstChild; child; child = child->nextSubling)
+        {
+            dump_slot* slot;
+
+            if (count == capacity)
+            {
+                dump_slot* grown;
+
+                capacity = capacity ? capacity * 2 : 64;
+                grown = (dump_slot*)realloc(*slots, sizeof(dump_slot) * capacity);
+                if (!grown)
+                {
+                    return -1;
+                }
+                *slots = grown;
+            }
+
+            slot = &(*slots)[count++];
+            slot->node = child;
+            slot->offset = offset;
+            slot->end = 0;
+            slot->task = node_dump_size(t, child) <= grain
+                      || !child->firstChild
+                      || (child->flags & NODE_FLAG_LAZY);
+
+            offset += node_dump_size(t, child);
+        }
+
+        while (cur < count && (*slots)[cur].task)
+        {
+            cur++;
+        }
+
+        if (cur == count)
+        {
+            break;
+        }
+
+        parent = (*slots)[cur].node;
+        offset = (*slots)[cur].offset;
+    }
+
+    return count;
+}
+
+size_t tlv_parallel_dumps(tlv_pool* pool, tlv* t, tlvbyte* buf, size_t bufsize)
+{
+    const tlv_codec* codec;
+    size_t needsize;
+    size_t grain;
+    size_t slotcount;
+    size_t taskcount = 0;
+    size_t i;
+    size_t dumped;
+    dump_slot* slots = NULL;
+    dump_job job;
+
+    if (!pool || !t || !t->root || !buf)
+    {
+        return 0;
+    }
+
+    // lengths are kept up to date bottom up as the tree is edited,
+    // layout only writes the l of the changed paths
+    needsize = tlv_layout(t);
+    if (needsize > bufsize)
+    {
+        return needsize;
+    }
+
+    codec = tlv_codec_of(t);
+    grain = needsize / (pool->threadcount * PARALLEL_TASKS_PER_WORKER);
+    grain = grain > PARALLEL_MIN_GRAIN ? grain : PARALLEL_MIN_GRAIN;
+
+    if (pool->threadcount == 1 || t->varint || needsize <= grain
+        || !t->root->firstChild || (t->root->flags & NODE_FLAG_LAZY))
+    {
+        return tlv_dumps(t, buf, bufsize);
+    }
+
+    slotcount = dump_split(t, codec, buf, grain, &slots);
+    if (slotcount == (size_t)-1)
+    {
+        free(slots);
+        return 0;
+    }
+
+    job.tlv = t;
+    job.codec = codec;
+    job.slots = slots;
+    job.buf = buf;
+    job.bufsize = bufsize;
+    job.workers = pool->threadcount;
+    job.tasks = (size_t*)malloc(sizeof(size_t) * (slotcount + 1));
+    job.ranges = NULL;
+
+    if (job.tasks)
+    {
+        for (i = 0; i < slotcount; i++)
+        {
+            if (slots[i].task)
+            {
+                job.tasks[taskcount++] = i;
+            }
+        }
+
+        job.ranges = ranges_obtain(job.workers, taskcount);
+    }
+
+    dumped = needsize;
+
+    if (job.ranges)
+    {
+        pool_run(pool, dump_job_run, &job);
+        ranges_destroy(job.ranges, job.workers);
+
+        for (i = 0; i < taskcount; i++)
+        {
+            dump_slot* slot = &slots[job.tasks[i]];
+
+            if (slot->end != slot->offset + node_dump_size(t, slot->node))
+            {
+                dumped = 0;
+            }
+        }
+    }
+    else
+    {
+        dumped = 0;
+    }
+
+    free(job.tasks);
+    free(slots);
+
+    return dumped;
+}
+
+
+/*
+ * variable leaf of a template
+ */
+typedef struct
+{
+    size_t hdroffset; // header of the leaf in image
+    size_t length; // value length now
+    size_t anc; // header offsets of its ancestors start at ancestors[anc]
+    size_t depth; // how many ancestors
+} template_slot;
+
+struct tlv_template
+{
+    tlv def; // geometry only, no tree
+    tlvbyte* image;
+    size_t size;
+    size_t capacity;
+    template_slot* slots;
+    size_t slotcount;
+    size_t* ancestors;
+};
+
+void tlv_template_destroy(tlv_template* tpl)
+{
+    if (!tpl)
+    {
+        return;
+    }
+
+    free(tpl->image);
+    free(tpl->slots);
+    free(tpl->ancestors);
+    free(tpl);
+}
+
+/*
+ * header offsets of node and its ancestors in the dump of t, root
+ * first into offsets, from the dump sizes of elder sublings
+ * returns: depth of node, root is 0
+ */
+static size_t template_offsets(tlv* t, tlvnode* node, size_t* offsets)
+{
+    size_t hdrsize = t->alength + t->tlength + t->llength;
+    size_t depth = 0;
+    size_t i;
+    tlvnode* n;
+
+    for (n = node; n->parent; n = n->parent)
+    {
+        depth++;
+    }
+
+    // walk down again, the chain is filled from the bottom
+    offsets[0] = 0;
+    i = depth;
+    for (n = node; n->parent; n = n->parent)
+    {
+        tlvnode* s;
+        size_t skip = 0;
+
+        for (s = n->parent->firstChild; s != n; s = s->nextSubling)
+        {
+            skip += node_dump_size(t, s);
+        }
+
+        offsets[i--] = skip;
+    }
+
+    for (i = 1; i <= depth; i++)
+    {
+        offsets[i] += offsets[i - 1] + hdrsize;
+    }
+
+    return depth;
+}
+
+tlv_template* tlv_template_obtain(tlv* t, tlvnode** slots, size_t slotcount)
+{
+    tlv_template* tpl;
+    size_t depthsum = 0;
+    size_t anc = 0;
+    size_t i;
+    tlvnode* n;
+
+    if (!t || !t->root || t->varint || (!slots && slotcount > 0))
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < slotcount; i++)
+    {
+        if (!slots[i] || slots[i]->firstChild
+            || tlv_node_get_attributes(t, slots[i], TLV_NODE_ATTR_IS_STRUCTUAL))
+        {
+            // leaves only
+            return NULL;
+        }
+
+        for (n = slots[i]; n->parent; n = n->parent)
+        {
+            depthsum++;
+        }
+
+        if (n != t->root)
+        {
+            return NULL;
+        }
+    }
+
+    tpl = (tlv_template*)calloc(1, sizeof(tlv_template));
+    if (!tpl)
+    {
+        return NULL;
+    }
+
+    tpl->def = *t;
+    tpl->def.root = NULL;
+    tpl->def.arena = NULL;
+    tpl->def.mapping = NULL;
+    tpl->def.mappingsize = 0;
+    tpl->def.index = NULL;
+
+    tpl->size = tlv_layout(t);
+    tpl->capacity = tpl->size;
+    tpl->image = (tlvbyte*)malloc(tpl->capacity);
+    tpl->slotcount = slotcount;
+    tpl->slots = (template_slot*)malloc(sizeof(template_slot) * (slotcount + 1));
+    // one more each for the offset of the slot itself
+    tpl->ancestors = (size_t*)malloc(sizeof(size_t) * (depthsum + slotcount + 1));
+
+    if (!tpl->image || !tpl->slots || !tpl->ancestors
+        || tlv_dumps(t, tpl->image, tpl->size) != tpl->size)
+    {
+        tlv_template_destroy(tpl);
+        return NULL;
+    }
+
+    for (i = 0; i < slotcount; i++)
+    {
+        template_slot* s = &tpl->slots[i];
+
+        s->anc = anc;
+        s->depth = template_offsets(t, slots[i], tpl->ancestors + anc);
+        s->hdroffset = tpl->ancestors[anc + s->depth];
+        s->length = slots[i]->length;
+        anc += s->depth + 1;
+    }
+
+    return tpl;
+}
+
+const tlvbyte* tlv_template_bytes(const tlv_template* tpl, size_t* size)
+{
+    if (!tpl)
+    {
+        return NULL;
+    }
+
+    if (size)
+    {
+        *size = tpl->size;
+    }
+
+    return tpl->image;
+}
+
+int tlv_template_set(tlv_template* tpl, size_t slot, const tlvbyte* vvalue, size_t vlength)
+{
+    const tlv* t;
+    const tlv_codec* codec;
+    template_slot* s;
+    size_t hdrsize;
+    size_t loff; // where l sits in a header
+    size_t voffset;
+    size_t oldend;
+    size_t i;
+
+    if (!tpl || slot >= tpl->slotcount || (!vvalue && vlength > 0))
+    {
+        return -1;
+    }
+
+    t = &tpl->def;
+    codec = codec_lookup(t);
+    s = &tpl->slots[slot];
+    hdrsize = t->alength + t->tlength + t->llength;
+    loff = t->alength + t->tlength;
+    voffset = s->hdroffset + hdrsize;
+
+    if (vlength == s->length)
+    {
+        // same size, patched in place
+        memcpy(tpl->image + voffset, vvalue, vlength);
+        return 0;
+    }
+
+    // every l on the path should still hold its length
+    if (vlength > max_length(t))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < s->depth; i++)
+    {
+        size_t a = tpl->ancestors[s->anc + i];
+        size_t length = codec->get_length(t, tpl->image + a + loff);
+
+        if (length - s->length > max_length(t) - vlength)
+        {
+            return -1;
+        }
+    }
+
+    if (tpl->size - s->length + vlength > tpl->capacity)
+    {
+        size_t capacity = (tpl->size - s->length + vlength) * 2;
+        tlvbyte* image = (tlvbyte*)realloc(tpl->image, capacity);
+        if (!image)
+        {
+            return -1;
+        }
+
+        tpl->image = image;
+        tpl->capacity = capacity;
+    }
+
+    // bytes after the value move, nothing before it does
+    oldend = voffset + s->length;
+    memmove(tpl->image + voffset + vlength, tpl->image + oldend, tpl->size - oldend);
+    memcpy(tpl->image + voffset, vvalue, vlength);
+    tpl->size = tpl->size - s->length + vlength;
+
+    codec->put_length(t, tpl->image + s->hdroffset + loff, vlength);
+    for (i = 0; i < s->depth; i++)
+    {
+        size_t a = tpl->ancestors[s->anc + i];
+        size_t length = codec->get_length(t, tpl->image + a + loff);
+
+        codec->put_length(t, tpl->image + a + loff, length - s->length + vlength);
+    }
+
+    // headers behind the value shift with it
+    for (i = 0; i < tpl->slotcount; i++)
+    {
+        template_slot* o = &tpl->slots[i];
+        size_t j;
+
+        for (j = 0; j <= o->depth; j++)
+        {
+            size_t* a = &tpl->ancestors[o->anc + j];
+
+            if (*a >= oldend)
+            {
+                *a = *a - s->length + vlength;
+            }
+        }
+
+        o->hdroffset = tpl->ancestors[o->anc + o->depth];
+    }
+
+    s->length = vlength;
+
+    return 0;
+}
+
+
+/*
+ * frozen tree: one block holding this struct, the node arrays and
+ * the encoded image the nodes point into
+ */
+struct tlv_frozen
+{
+    tlv def; // geometry only, no tree
+    size_t refcount;
+
+    size_t count;
+    size_t* hoffset; // header of each node in image
+    size_t* next; // index right after the subtree of each node
+    size_t* parent;
+
+    const tlvbyte* image;
+    size_t size;
+};
+
+tlv_frozen* tlv_freeze(tlv* t)
+{
+    const tlv_codec* codec;
+    size_t hdrsize;
+    size_t size;
+    size_t count;
+    size_t index = 0;
+    size_t open = TLV_FLAT_NONE;
+    size_t i;
+    tlvbyte* image;
+    tlv_frozen* f;
+
+    if (!t || !t->root || t->varint)
+    {
+        return NULL;
+    }
+
+    codec = tlv_codec_of(t);
+    hdrsize = t->alength + t->tlength + t->llength;
+    size = tlv_layout(t);
+    count = tlv_node_count(t);
+
+    f = (tlv_frozen*)malloc(sizeof(tlv_frozen) + sizeof(size_t) * count * 3 + size);
+    if (!f)
+    {
+        return NULL;
+    }
+
+    f->def = *t;
+    f->def.root = NULL;
+    f->def.arena = NULL;
+    f->def.mapping = NULL;
+    f->def.mappingsize = 0;
+    f->def.index = NULL;
+    f->refcount = 1;
+    f->count = count;
+    f->hoffset = (size_t*)(f + 1);
+    f->next = f->hoffset + count;
+    f->parent = f->next + count;
+    image = (tlvbyte*)(f->parent + count);
+    f->image = image;
+    f->size = size;
+
+    if (tlv_dumps(t, image, size) != size)
+    {
+        free(f);
+        return NULL;
+    }
+
+    // preorder, the open constructed nodes are chained by parent
+    for (i = 0; i < count; i++)
+    {
+        size_t length = codec->get_length(t, f->image + index + t->alength + t->tlength);
+
+        f->hoffset[i] = index;
+        f->parent[i] = open;
+        index += hdrsize;
+
+        if (attr_bit(f->image + f->hoffset[i], TLV_NODE_ATTR_IS_STRUCTUAL) && length > 0)
+        {
+            open = i;
+            continue;
+        }
+
+        f->next[i] = i + 1;
+        if (!attr_bit(f->image + f->hoffset[i], TLV_NODE_ATTR_IS_STRUCTUAL))
+        {
+            index += length;
+        }
+
+        while (open != TLV_FLAT_NONE
+                && f->hoffset[open] + hdrsize
+                   + codec->get_length(t, f->image + f->hoffset[open] + t->alength + t->tlength) == index)
+        {
+            f->next[open] = i + 1;
+            open = f->parent[open];
+        }
+    }
+
+    return f;
+}
+
+tlv_frozen* tlv_frozen_retain(tlv_frozen* f)
+{
+    if (f)
+    {
+        __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+    }
+
+    return f;
+}
+
+void tlv_frozen_release(tlv_frozen* f)
+{
+    if (f && __atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(f);
+    }
+}
+
+size_t tlv_frozen_count(const tlv_frozen* f)
+{
+    return f ? f->count : 0;
+}
+
+const tlvbyte* tlv_frozen_bytes(const tlv_frozen* f, size_t* size)
+{
+    if (!f)
+    {
+        return NULL;
+    }
+
+    if (size)
+    {
+        *size = f->size;
+    }
+
+    return f->image;
+}
+
+const tlv* tlv_frozen_geometry(const tlv_frozen* f)
+{
+    return f ? &f->def : NULL;
+}
+
+size_t tlv_frozen_parent(const tlv_frozen* f, size_t index)
+{
+    if (!f || index >= f->count)
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    return f->parent[index];
+}
+
+size_t tlv_frozen_first_child(const tlv_frozen* f, size_t index)
+{
+    if (!f || index >= f->count || f->next[index] == index + 1)
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    return index + 1;
+}
+
+size_t tlv_frozen_next_subling(const tlv_frozen* f, size_t index)
+{
+    size_t parent;
+
+    if (!f || index >= f->count)
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    parent = f->parent[index];
+    if (parent == TLV_FLAT_NONE || f->next[index] == f->next[parent])
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    return f->next[index];
+}
+
+int tlv_frozen_is_structual(const tlv_frozen* f, size_t index)
+{
+    if (!f || index >= f->count)
+    {
+        return 0;
+    }
+
+    return attr_bit(f->image + f->hoffset[index], TLV_NODE_ATTR_IS_STRUCTUAL) != 0;
+}
+
+const tlvbyte* tlv_frozen_t(const tlv_frozen* f, size_t index)
+{
+    if (!f || index >= f->count)
+    {
+        return NULL;
+    }
+
+    return f->image + f->hoffset[index] + f->def.alength;
+}
+
+const tlvbyte* tlv_frozen_v(const tlv_frozen* f, size_t index, size_t* length)
+{
+    const tlvbyte* hdr;
+
+    if (!f || index >= f->count)
+    {
+        return NULL;
+    }
+
+    hdr = f->image + f->hoffset[index];
+    if (length)
+    {
+        *length = codec_lookup(&f->def)->get_length(&f->def, hdr + f->def.alength + f->def.tlength);
+    }
+
+    return hdr + f->def.alength + f->def.tlength + f->def.llength;
+}
+
+size_t tlv_frozen_find_child(const tlv_frozen* f, size_t index, const tlvbyte* tvalue, size_t tlength)
+{
+    size_t child;
+
+    for (child = tlv_frozen_first_child(f, index); child != TLV_FLAT_NONE;
+         child = tlv_frozen_next_subling(f, child))
+    {
+        if (tag_bytes_equal(&f->def, tlv_frozen_t(f, child), tvalue, tlength))
+        {
+            return child;
+        }
+    }
+
+    return TLV_FLAT_NONE;
+}
+
+int tlv_frozen_traverse(const tlv_frozen* f, int (*callback)(const tlv_frozen*, size_t, void*), void* arg)
+{
+    size_t i;
+
+    if (!f || !callback)
+    {
+        return 0;
+    }
+
+    // preorder is the order of the arrays
+    for (i = 0; i < f->count; i++)
+    {
+        if (callback(f, i, arg))
+        {
+            return i + 1;
+        }
+    }
+
+    return f->count;
+}
+
+
+/*
+ * one file operation of an aio, from queued to reaped
+ */
+typedef struct aio_op
+{
+    int load; // 1 for tlv_aio_load, 0 for a dump
+    int fd;
+    char* path;
+    tlv def; // geometry of the tree to load
+    size_t arenachunk; // 0 if the tree goes without arena
+    tlvbyte* buf; // read buffer, anonymous mapping so the tree may keep it
+    size_t size; // bytes to transfer in all
+    size_t done; // bytes transferred so far
+    struct iovec* iovs; // as allocated
+    struct iovec* iov; // what is left, advanced as bytes are transferred
+    size_t iovcount;
+    int error;
+    tlv_aio_loaded loaded;
+    tlv_aio_dumped dumped;
+    void* arg;
+    struct aio_op* next;
+} aio_op;
+
+struct tlv_aio
+{
+    tlv_aio_backend_t backend;
+    size_t depth;
+    size_t pending; // queued, in flight or ready
+    size_t inflight; // handed over, not completed yet
+
+    aio_op* queued; // not handed over yet
+    aio_op* queuedtail;
+
+    pthread_mutex_t lock; // guards ready, and the thread fields below
+    aio_op* ready; // completed, not reaped yet
+
+    // TLV_AIO_THREADS
+    pthread_t* threads;
+    size_t threadcount;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    aio_op* todo;
+    aio_op* todotail;
+    int quit;
+
+#ifdef AIO_HAVE_URING
+    // TLV_AIO_URING
+    int ring;
+    void* sqmap;
+    size_t sqmapsize;
+    void* cqmap;
+    size_t cqmapsize;
+    struct io_uring_sqe* sqes;
+    size_t sqessize;
+    unsigned* sqtail;
+    unsigned* sqmask;
+    unsigned* sqarray;
+    unsigned* cqhead;
+    unsigned* cqtail;
+    unsigned* cqmask;
+    struct io_uring_cqe* cqes;
+    size_t unsubmitted; // in the submission ring, not taken by the kernel yet
+#endif
+};
+
+static void aio_op_free(aio_op* op)
+{
+    if (op->fd >= 0)
+    {
+        close(op->fd);
+    }
+
+    if (op->buf)
+    {
+        munmap(op->buf, op->size);
+    }
+
+    free(op->iovs);
+    free(op->path);
+    free(op);
+}
+
+/*
+ * account n more bytes transferred by op
+ */
+static void aio_op_advance(aio_op* op, size_t n)
+{
+    op->done += n;
+
+    while (n > 0 && op->iovcount > 0)
+    {
+        if (n >= op->iov->iov_len)
+        {
+            n -= op->iov->iov_len;
+            op->iov++;
+            op->iovcount--;
+        }
+        else
+        {
+            op->iov->iov_base = (tlvbyte*)op->iov->iov_base + n;
+            op->iov->iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+static void aio_enqueue(tlv_aio* aio, aio_op* op)
+{
+    op->next = NULL;
+
+    if (aio->queuedtail)
+    {
+        aio->queuedtail->next = op;
+    }
+    else
+    {
+        aio->queued = op;
+    }
+
+    aio->queuedtail = op;
+}
+
+static aio_op* aio_dequeue(tlv_aio* aio)
+{
+    aio_op* op = aio->queued;
+
+    aio->queued = op->next;
+    if (!aio->queued)
+    {
+        aio->queuedtail = NULL;
+    }
+
+    return op;
+}
+
+/*
+ * completed op goes to ready, to be reaped by tlv_aio_poll
+ */
+static void aio_ready(tlv_aio* aio, aio_op* op)
+{
+    pthread_mutex_lock(&aio->lock);
+    op->next = aio->ready;
+    aio->ready = op;
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/*
+ * decode what op read, hand the outcome to its callback and free op
+ */
+static void aio_finish(aio_op* op)
+{
+    tlv* tree = NULL;
+
+    if (!op->load)
+    {
+        if (op->dumped)
+        {
+            op->dumped(op->path, op->error, op->arg);
+        }
+
+        aio_op_free(op);
+        return;
+    }
+
+    if (!op->error)
+    {
+        tree = tlv_obtain();
+        tree->alength = op->def.alength;
+        tree->tlength = op->def.tlength;
+        tree->llength = op->def.llength;
+        tree->byteprio = op->def.byteprio;
+        tree->varint = op->def.varint;
+        tree->loadmode = op->def.loadmode;
+        tree->compress = op->def.compress;
+
+        if (op->arenachunk)
+        {
+            tlv_use_arena(tree, op->arenachunk);
+        }
+
+        if (tlv_loads(tree, op->buf, op->size) != op->size)
+        {
+            tlv_destroy(tree);
+            tree = NULL;
+            op->error = EINVAL;
+        }
+        else if (tree->loadmode != TLV_LOAD_COPY)
+        {
+            // nodes point into the buffer, it goes with the tlv
+            tree->mapping = op->buf;
+            tree->mappingsize = op->size;
+            op->buf = NULL;
+        }
+    }
+
+    if (op->loaded)
+    {
+        op->loaded(tree, op->path, op->error, op->arg);
+    }
+    else
+    {
+        tlv_destroy(tree);
+    }
+
+    aio_op_free(op);
+}
+
+/*
+ * blocking transfer of everything op has left, for the thread backend
+ * returns: 0 if succeed, an errno value otherwise
+ */
+static int aio_transfer(aio_op* op)
+{
+    while (op->done < op->size)
+    {
+        int count = op->iovcount < AIO_IOV_MAX ? (int)op->iovcount : AIO_IOV_MAX;
+        ssize_t n = op->load
+                  ? preadv(op->fd, op->iov, count, op->done)
+                  : pwritev(op->fd, op->iov, count, op->done);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
             {
-                node->v[vi] = bytes[index++];
+                continue;
             }
 
-            while (1)
-            {
-                int n;
-                int* pindex = (int*)stack_pop(lstack);
-                n = *pindex;
+            return errno;
+        }
+
+        if (n == 0)
+        {
+            // file shrank under a load
+            return EIO;
+        }
+
+        aio_op_advance(op, n);
+    }
+
+    return 0;
+}
+
+static void* aio_thread(void* arg)
+{
+    tlv_aio* aio = (tlv_aio*)arg;
+
+    pthread_mutex_lock(&aio->lock);
+
+    for (;;)
+    {
+        aio_op* op;
+
+        while (!aio->todo && !aio->quit)
+        {
+            pthread_cond_wait(&aio->work, &aio->lock);
+        }
+
+        if (!aio->todo)
+        {
+            break;
+        }
+
+        op = aio->todo;
+        aio->todo = op->next;
+        if (!aio->todo)
+        {
+            aio->todotail = NULL;
+        }
+
+        pthread_mutex_unlock(&aio->lock);
+        op->error = aio_transfer(op);
+        pthread_mutex_lock(&aio->lock);
+
+        op->next = aio->ready;
+        aio->ready = op;
+        aio->inflight--;
+        pthread_cond_signal(&aio->done);
+    }
+
+    pthread_mutex_unlock(&aio->lock);
+
+    return NULL;
+}
+
+static int aio_threads_start(tlv_aio* aio)
+{
+    size_t count = aio->depth < AIO_THREADS ? aio->depth : AIO_THREADS;
+
+    aio->threads = (pthread_t*)malloc(sizeof(pthread_t) * count);
+    if (!aio->threads)
+    {
+        return -1;
+    }
+
+    while (aio->threadcount < count)
+    {
+        if (pthread_create(&aio->threads[aio->threadcount], NULL, aio_thread, aio))
+        {
+            break;
+        }
+
+        aio->threadcount++;
+    }
+
+    return aio->threadcount > 0 ? 0 : -1;
+}
+
+static void aio_threads_stop(tlv_aio* aio)
+{
+    size_t i;
+
+    pthread_mutex_lock(&aio->lock);
+    aio->quit = 1;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+
+    for (i = 0; i < aio->threadcount; i++)
+    {
+        pthread_join(aio->threads[i], NULL);
+    }
+
+    free(aio->threads);
+}
+
+/*
+ * hand every queued op to the threads
+ */
+static int aio_threads_submit(tlv_aio* aio)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&aio->lock);
+
+    while (aio->queued)
+    {
+        aio_op* op = aio_dequeue(aio);
+
+        op->next = NULL;
+        if (aio->todotail)
+        {
+            aio->todotail->next = op;
+        }
+        else
+        {
+            aio->todo = op;
+        }
+
+        aio->todotail = op;
+        aio->inflight++;
+        count++;
+    }
+
+    if (count)
+    {
+        pthread_cond_broadcast(&aio->work);
+    }
+
+    pthread_mutex_unlock(&aio->lock);
+
+    return count;
+}
+
+static void aio_threads_wait(tlv_aio* aio)
+{
+    pthread_mutex_lock(&aio->lock);
+
+    while (!aio->ready && aio->inflight > 0)
+    {
+        pthread_cond_wait(&aio->done, &aio->lock);
+    }
+
+    pthread_mutex_unlock(&aio->lock);
+}
+
+#ifdef AIO_HAVE_URING
+
+static int aio_uring_enter(tlv_aio* aio, size_t submit, size_t wait)
+{
+    for (;;)
+    {
+        long n = syscall(__NR_io_uring_enter, aio->ring, (unsigned)submit, (unsigned)wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (n >= 0)
+        {
+            aio->unsubmitted -= (size_t)n < submit ? (size_t)n : submit;
+            return 0;
+        }
+
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+static int aio_uring_start(tlv_aio* aio)
+{
+    struct io_uring_params p;
+    int single;
+
+    memset(&p, 0, sizeof(p));
+    aio->ring = (int)syscall(__NR_io_uring_setup, (unsigned)aio->depth, &p);
+    if (aio->ring < 0)
+    {
+        return -1;
+    }
+
+    // the kernel rounds entries up to a power of 2
+    aio->depth = p.sq_entries;
+
+    aio->sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+    {
+        // both rings share one mapping
+        if (aio->cqmapsize > aio->sqmapsize)
+        {
+            aio->sqmapsize = aio->cqmapsize;
+        }
+
+        aio->cqmapsize = aio->sqmapsize;
+    }
+
+    aio->sqmap = mmap(NULL, aio->sqmapsize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, aio->ring, IORING_OFF_SQ_RING);
+    if (aio->sqmap == MAP_FAILED)
+    {
+        aio->sqmap = NULL;
+        return -1;
+    }
+
+    if (single)
+    {
+        aio->cqmap = aio->sqmap;
+    }
+    else
+    {
+        aio->cqmap = mmap(NULL, aio->cqmapsize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, aio->ring, IORING_OFF_CQ_RING);
+        if (aio->cqmap == MAP_FAILED)
+        {
+            aio->cqmap = NULL;
+            return -1;
+        }
+    }
+
+    aio->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = (struct io_uring_sqe*)mmap(NULL, aio->sqessize, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, aio->ring, IORING_OFF_SQES);
+    if (aio->sqes == MAP_FAILED)
+    {
+        aio->sqes = NULL;
+        return -1;
+    }
+
+    aio->sqtail = (unsigned*)((char*)aio->sqmap + p.sq_off.tail);
+    aio->sqmask = (unsigned*)((char*)aio->sqmap + p.sq_off.ring_mask);
+    aio->sqarray = (unsigned*)((char*)aio->sqmap + p.sq_off.array);
+    aio->cqhead = (unsigned*)((char*)aio->cqmap + p.cq_off.head);
+    aio->cqtail = (unsigned*)((char*)aio->cqmap + p.cq_off.tail);
+    aio->cqmask = (unsigned*)((char*)aio->cqmap + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe*)((char*)aio->cqmap + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void aio_uring_stop(tlv_aio* aio)
+{
+    if (aio->sqes)
+    {
+        munmap(aio->sqes, aio->sqessize);
+    }
+
+    if (aio->cqmap && aio->cqmap != aio->sqmap)
+    {
+        munmap(aio->cqmap, aio->cqmapsize);
+    }
+
+    if (aio->sqmap)
+    {
+        munmap(aio->sqmap, aio->sqmapsize);
+    }
+
+    if (aio->ring >= 0)
+    {
+        close(aio->ring);
+    }
+}
+
+/*
+ * put queued ops into the submission ring while there is room,
+ * the completion ring has twice as much, so it never overflows
+ */
+static int aio_uring_submit(tlv_aio* aio)
+{
+    int count = 0;
+    unsigned tail = *aio->sqtail;
+
+    while (aio->queued && aio->inflight < aio->depth)
+    {
+        aio_op* op = aio_dequeue(aio);
+        unsigned i = tail & *aio->sqmask;
+        struct io_uring_sqe* sqe = &aio->sqes[i];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op->load ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd = op->fd;
+        sqe->addr = (unsigned long long)(uintptr_t)op->iov;
+        sqe->len = op->iovcount < AIO_IOV_MAX ? op->iovcount : AIO_IOV_MAX;
+        sqe->off = op->done;
+        sqe->user_data = (unsigned long long)(uintptr_t)op;
+        aio->sqarray[i] = i;
+
+        tail++;
+        aio->inflight++;
+        aio->unsubmitted++;
+        count++;
+    }
+
+    // sqes are written before the kernel sees the new tail
+    __atomic_store_n(aio->sqtail, tail, __ATOMIC_RELEASE);
+
+    if (aio->unsubmitted && aio_uring_enter(aio, aio->unsubmitted, 0))
+    {
+        return -1;
+    }
+
+    return count;
+}
+
+/*
+ * move completions out of the ring, ops only partly
+ * transferred are queued again for the rest
+ */
+static void aio_uring_reap(tlv_aio* aio)
+{
+    unsigned head = *aio->cqhead;
+    unsigned tail = __atomic_load_n(aio->cqtail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe* cqe = &aio->cqes[head & *aio->cqmask];
+        aio_op* op = (aio_op*)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+
+        head++;
+        aio->inflight--;
 
-                if (n == index)
-                {
-                    curparent = curparent->parent;
-                    free(pindex);
-                    if (curparent == NULL)
-                    {
-                        break;
-                    }
-                }
-                else
-                {
-                    stack_push(lstack, pindex);
-                    break;
-                }
-            }
+        if (res < 0 && res != -EINTR && res != -EAGAIN)
+        {
+            op->error = -res;
+        }
+        else if (res == 0 && op->done < op->size)
+        {
+            // file shrank under a load
+            op->error = EIO;
+        }
+        else if (res > 0)
+        {
+            aio_op_advance(op, res);
         }
 
-        if (node == tlv->root)
+        if (!op->error && op->done < op->size)
         {
-            byteshandled = tlv->alength
-                        + tlv->tlength  
-                        + tlv->llength
-                        + tlv->root->length;
+            aio_enqueue(aio, op);
         }
+        else
+        {
+            aio_ready(aio, op);
+        }
+    }
 
-    } // index < size
+    __atomic_store_n(aio->cqhead, head, __ATOMIC_RELEASE);
+}
 
-    //tlv_layout(tlv);
+#endif // AIO_HAVE_URING
 
-    stack_destroy(lstack);
-    return byteshandled;
+tlv_aio* tlv_aio_obtain(size_t depth, tlv_aio_backend_t backend)
+{
+    tlv_aio* aio = (tlv_aio*)calloc(1, sizeof(tlv_aio));
+
+    if (!aio)
+    {
+        return NULL;
+    }
+
+    aio->depth = depth ? depth : AIO_DEF_DEPTH;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->done, NULL);
+
+#ifdef AIO_HAVE_URING
+    aio->ring = -1;
+
+    if (backend != TLV_AIO_THREADS)
+    {
+        if (aio_uring_start(aio) == 0)
+        {
+            aio->backend = TLV_AIO_URING;
+            return aio;
+        }
+
+        aio_uring_stop(aio);
+        aio->ring = -1;
+        aio->sqmap = aio->cqmap = NULL;
+        aio->sqes = NULL;
+        aio->depth = depth ? depth : AIO_DEF_DEPTH;
+    }
+#endif
+
+    if (backend != TLV_AIO_URING && aio_threads_start(aio) == 0)
+    {
+        aio->backend = TLV_AIO_THREADS;
+        return aio;
+    }
+
+    tlv_aio_destroy(aio);
+    return NULL;
+}
+
+void tlv_aio_destroy(tlv_aio* aio)
+{
+    if (!aio)
+    {
+        return;
+    }
+
+    // every op pending still refers to caller buffers and callbacks
+    while (aio->pending > 0 && tlv_aio_poll(aio, aio->pending) >= 0);
+
+    if (aio->backend == TLV_AIO_THREADS || aio->threadcount > 0)
+    {
+        aio_threads_stop(aio);
+    }
+    else
+    {
+        free(aio->threads);
+    }
+
+#ifdef AIO_HAVE_URING
+    if (aio->backend == TLV_AIO_URING)
+    {
+        aio_uring_stop(aio);
+    }
+#endif
+
+    pthread_cond_destroy(&aio->done);
+    pthread_cond_destroy(&aio->work);
+    pthread_mutex_destroy(&aio->lock);
+    free(aio);
 }
 
+tlv_aio_backend_t tlv_aio_backend(const tlv_aio* aio)
+{
+    return aio ? aio->backend : TLV_AIO_AUTO;
+}
 
-static size_t write_buf_from_index(tlv* tlv, tlvnode* node, tlvbyte* buf, size_t bufsize, size_t index)
+static aio_op* aio_op_obtain(const char* path, int fd, const struct iovec* iov, size_t iovcount)
 {
+    aio_op* op = (aio_op*)calloc(1, sizeof(aio_op));
     size_t i;
-    int hasChild;
-    tlv_node_attr_t attr = TLV_NODE_ATTR_IS_STRUCTUAL;
 
-    if (!tlv || !node || !buf || bufsize <= 0 || index < 0)
+    if (!op)
     {
-        return 0;
+        close(fd);
+        return NULL;
+    }
+
+    op->fd = fd;
+    op->path = strdup(path);
+    op->iovs = (struct iovec*)malloc(sizeof(struct iovec) * (iovcount ? iovcount : 1));
+
+    if (!op->path || !op->iovs)
+    {
+        aio_op_free(op);
+        return NULL;
     }
 
-    for (i = 0; i < tlv->alength; i++)
+    for (i = 0; i < iovcount; i++)
     {
-        buf[index++] =  node->a[i];
-        if (index >= bufsize)
-            return -1;
+        op->iovs[i] = iov[i];
+        op->size += iov[i].iov_len;
     }
 
-    for (i = 0; i < tlv->tlength; i++)
+    op->iov = op->iovs;
+    op->iovcount = iovcount;
+
+    return op;
+}
+
+int tlv_aio_load(tlv_aio* aio, const tlv* def, const char* path, tlv_aio_loaded callback, void* arg)
+{
+    int fd;
+    struct stat st;
+    struct iovec iov;
+    tlvbyte* buf;
+    aio_op* op;
+
+    if (!aio || !def || !path)
     {
-        buf[index++] =  node->t[i];
-        if (index >= bufsize)
-            return -1;
+        return -1;
     }
 
-    for (i = 0;i < tlv->llength;i++)
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
     {
-        buf[index++] =  node->l[i];
-        if (index >= bufsize)
-            return -1;
+        return -1;
     }
 
-    hasChild = tlv_node_get_attributes(tlv, node,attr);
-    if (!hasChild)
+    if (fstat(fd, &st) || st.st_size <= 0)
     {
-        for (i = 0;i < node->length; i++)
-        {
+        close(fd);
+        return -1;
+    }
 
-            buf[index++] = node->v[i]; 
-            if (index >= bufsize)
-            {
-                return -1;
-            }
-        }   
+    buf = (tlvbyte*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
     }
 
-    return index;
+    iov.iov_base = buf;
+    iov.iov_len = st.st_size;
+    op = aio_op_obtain(path, fd, &iov, 1);
+    if (!op)
+    {
+        munmap(buf, st.st_size);
+        return -1;
+    }
+
+    op->load = 1;
+    op->buf = buf;
+    op->def = *def;
+    op->arenachunk = def->arena ? def->arena->chunksize : 0;
+    op->loaded = callback;
+    op->arg = arg;
+
+    aio_enqueue(aio, op);
+    aio->pending++;
+
+    return 0;
 }
 
-static tlvnode* tlv_node_last_child(tlvnode* n)
+int tlv_aio_dump(tlv_aio* aio, const char* path, const tlvbyte* buf, size_t size,
+                 tlv_aio_dumped callback, void* arg)
 {
-    tlvnode* curnode;
+    struct iovec iov;
 
-    if (!n)
+    if (!buf && size > 0)
     {
-        return NULL;
+        return -1;
+    }
+
+    iov.iov_base = (void*)buf;
+    iov.iov_len = size;
+
+    return tlv_aio_dumpv(aio, path, &iov, 1, callback, arg);
+}
+
+int tlv_aio_dumpv(tlv_aio* aio, const char* path, const struct iovec* iov, size_t iovcount,
+                  tlv_aio_dumped callback, void* arg)
+{
+    int fd;
+    aio_op* op;
+
+    if (!aio || !path || (!iov && iovcount > 0))
+    {
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    op = aio_op_obtain(path, fd, iov, iovcount);
+    if (!op)
+    {
+        return -1;
+    }
+
+    op->dumped = callback;
+    op->arg = arg;
+
+    aio_enqueue(aio, op);
+    aio->pending++;
+
+    return 0;
+}
+
+int tlv_aio_submit(tlv_aio* aio)
+{
+    aio_op* op;
+    aio_op* rest = NULL;
+    int count = 0;
+
+    if (!aio)
+    {
+        return -1;
+    }
+
+    // nothing to transfer, nothing to hand over
+    while (aio->queued)
+    {
+        op = aio_dequeue(aio);
+        if (op->done < op->size)
+        {
+            op->next = rest;
+            rest = op;
+        }
+        else
+        {
+            aio_ready(aio, op);
+            count++;
+        }
     }
 
-    curnode = n->firstChild;
-    if (curnode)
+    while (rest)
     {
-        while (curnode->nextSubling)
+        op = rest;
+        rest = rest->next;
+        op->next = aio->queued;
+        aio->queued = op;
+        if (!aio->queuedtail)
         {
-            curnode = curnode->nextSubling;
+            aio->queuedtail = op;
         }
+    }
+
+    if (!aio->queued)
+    {
+        return count;
+    }
 
-        return curnode;
+#ifdef AIO_HAVE_URING
+    if (aio->backend == TLV_AIO_URING)
+    {
+        int n = aio_uring_submit(aio);
+        return n < 0 ? -1 : count + n;
     }
+#endif
 
-    return NULL;
+    return count + aio_threads_submit(aio);
 }
 
-/*
- * dump tlv struct into bytes.
- * returns byte length.
- */
-size_t tlv_dumps(tlv* tlv, tlvbyte* buf, size_t bufsize)
+int tlv_aio_poll(tlv_aio* aio, size_t min)
 {
-    size_t needsize;
-    size_t buf_index = 0;
+    int completed = 0;
 
-    if (!tlv || !buf || bufsize < 0)
+    if (!aio || tlv_aio_submit(aio) < 0)
     {
         return -1;
     }
 
-    _stack* dumpsStack = stack_obtain(STACK_INIT_SIZE);
+    if (min > aio->pending)
+    {
+        min = aio->pending;
+    }
+
+    for (;;)
+    {
+        aio_op* ready;
+        size_t inflight;
 
-    tlvnode* curnode = tlv->root;
+#ifdef AIO_HAVE_URING
+        if (aio->backend == TLV_AIO_URING)
+        {
+            aio_uring_reap(aio);
 
-    needsize = tlv->tlength + tlv->llength + tlv->root->length;
+            // partly transferred ones go again
+            if (aio->queued && aio_uring_submit(aio) < 0)
+            {
+                return -1;
+            }
+        }
+#endif
 
-    stack_push(dumpsStack, curnode);
+        // threads move an op to ready and count it off inflight
+        // under the lock, both are taken in one go
+        pthread_mutex_lock(&aio->lock);
+        ready = aio->ready;
+        aio->ready = NULL;
+        inflight = aio->inflight;
+        pthread_mutex_unlock(&aio->lock);
 
-    while (dumpsStack->index > 0)
-    {
-        tlvnode* child;
-        curnode = (tlvnode*) stack_pop(dumpsStack);
-        child = tlv_node_last_child(curnode);
-        while (child)
+        while (ready)
+        {
+            aio_op* op = ready;
+            ready = ready->next;
+
+            aio->pending--;
+            completed++;
+            aio_finish(op);
+        }
+
+        if ((size_t)completed >= min || inflight == 0)
         {
-            stack_push(dumpsStack, child);
-            child = child->prevSubling;
+            break;
         }
-        buf_index = write_buf_from_index(tlv, curnode, buf, bufsize, buf_index);
-        if (buf_index < 0)
+
+#ifdef AIO_HAVE_URING
+        if (aio->backend == TLV_AIO_URING)
         {
-            return needsize;
+            if (aio_uring_enter(aio, aio->unsubmitted, 1))
+            {
+                return -1;
+            }
+
+            continue;
         }
+#endif
 
+        aio_threads_wait(aio);
     }
 
-    stack_destroy(dumpsStack);
-    return buf_index;
+    return completed;
 }
 
+size_t tlv_aio_pending(const tlv_aio* aio)
+{
+    return aio ? aio->pending : 0;
+}
 
 
-static void free_tlv_node(tlvnode* node)
+/*
+ * 8 bytes LSB first, the byte order of log footers on every host
+ */
+static size_t log_get64(const tlvbyte* p)
 {
-    if (!node)
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
     {
-        return;
+        v = (v << 8) | p[i];
+    }
+
+    return (size_t)v;
+}
+
+static void log_put64(tlvbyte* p, size_t value)
+{
+    uint64_t v = value;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        p[i] = (tlvbyte)v;
+        v >>= 8;
+    }
+}
+
+/*
+ * compare tag ntag of t with tvalue zero padded to tlength,
+ * as tag_bytes_equal does for equality
+ * returns: <0, 0, >0 as memcmp
+ */
+static int log_tag_cmp(const tlv* t, const tlvbyte* ntag, const tlvbyte* tvalue, size_t tlength)
+{
+    size_t i;
+    size_t n = tlength < t->tlength ? tlength : t->tlength;
+    int cmp = memcmp(ntag, tvalue, n);
+
+    if (cmp)
+    {
+        return cmp;
+    }
+
+    for (i = n; i < t->tlength; i++)
+    {
+        if (ntag[i])
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+struct tlv_log
+{
+    tlv def;
+    tlvbyte* mapping;
+    size_t mappingsize;
+    size_t count;
+    size_t end; // where records end and footer starts
+    const tlvbyte* footer; // offsets in the footer, NULL if the log was scanned
+    size_t* offsets; // count of them, if the log was scanned
+    size_t blockrecords;
+    const tlvbyte* blocks; // min, max tag of every block, NULL if none
+};
+
+static size_t log_offset(const tlv_log* log, size_t n)
+{
+    if (n >= log->count)
+    {
+        return log->end;
+    }
+
+    return log->footer ? log_get64(log->footer + 8 * n) : log->offsets[n];
+}
+
+/*
+ * take record offsets and blocks from the footer of log
+ * returns: 0 if succeed, -1 if there is no sound footer
+ */
+static int log_read_footer(tlv_log* log)
+{
+    const tlvbyte* trailer;
+    size_t count;
+    size_t blockrecords;
+    size_t tlength;
+    size_t footeroffset;
+    size_t blocks;
+    size_t footersize;
+
+    if (log->mappingsize < LOG_TRAILER_SIZE)
+    {
+        return -1;
+    }
+
+    trailer = log->mapping + log->mappingsize - LOG_TRAILER_SIZE;
+    if (memcmp(trailer, LOG_MAGIC, 8))
+    {
+        return -1;
+    }
+
+    count = log_get64(trailer + 8);
+    blockrecords = log_get64(trailer + 16);
+    tlength = log_get64(trailer + 24);
+    footeroffset = log_get64(trailer + 32);
+
+    if (tlength != log->def.tlength
+            || footeroffset > log->mappingsize - LOG_TRAILER_SIZE
+            || count > log->mappingsize / 8)
+    {
+        return -1;
+    }
+
+    blocks = blockrecords ? (count + blockrecords - 1) / blockrecords : 0;
+    footersize = log->mappingsize - LOG_TRAILER_SIZE - footeroffset;
+
+    if (blocks > footersize || footersize != count * 8 + blocks * 2 * tlength)
+    {
+        return -1;
     }
 
-    if (node->a)
+    log->count = count;
+    log->end = footeroffset;
+    log->footer = log->mapping + footeroffset;
+    log->blockrecords = blockrecords;
+    log->blocks = blocks ? log->footer + count * 8 : NULL;
+
+    return 0;
+}
+
+/*
+ * find records by hopping over root l, up to the first one
+ * which is cut short
+ */
+static int log_scan(tlv_log* log)
+{
+    const tlv_codec* codec = codec_lookup(&log->def);
+    size_t hdrsize = log->def.alength + log->def.tlength + log->def.llength;
+    size_t capacity = 0;
+    size_t pos = 0;
+
+    while (log->mappingsize - pos >= hdrsize)
     {
-        free(node->a);
-        node->a = NULL;
+        size_t length = codec->get_length(&log->def, log->mapping + pos + log->def.alength + log->def.tlength);
+        if (length > log->mappingsize - pos - hdrsize)
+        {
+            break;
+        }
+
+        if (log->count == capacity)
+        {
+            size_t* offsets;
+
+            capacity = capacity ? capacity * 2 : 64;
+            offsets = (size_t*)realloc(log->offsets, sizeof(size_t) * capacity);
+            if (!offsets)
+            {
+                return -1;
+            }
+
+            log->offsets = offsets;
+        }
+
+        log->offsets[log->count++] = pos;
+        pos += hdrsize + length;
     }
 
-    if (node->t)
+    log->end = pos;
+
+    return 0;
+}
+
+tlv_log* tlv_log_obtain(const tlv* def, const char* path)
+{
+    tlv_log* log;
+    int fd;
+    struct stat st;
+
+    if (!def || def->varint || !path)
     {
-        free(node->t);
-        node->t = NULL;
+        return NULL;
     }
 
-    if (node->l)
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
     {
-        free(node->l);
-        node->l = NULL;
+        return NULL;
     }
 
-    if (node->v)
+    if (fstat(fd, &st))
     {
-        free(node->v);
-        node->v = NULL;
+        close(fd);
+        return NULL;
     }
 
-    free(node);
-}
-
-void tlv_node_destroy(tlv* tlv, tlvnode* node)
-{
-    if (!tlv || !node)
+    log = (tlv_log*)calloc(1, sizeof(tlv_log));
+    if (!log)
     {
-        return;
+        close(fd);
+        return NULL;
     }
 
-    _stack* desStack = stack_obtain(STACK_INIT_SIZE);
-    tlvnode* curnode = node;
-    stack_push(desStack, curnode);
-    while (desStack->index > 0)
+    log->def = *def;
+    log->mappingsize = st.st_size;
+
+    if (log->mappingsize > 0)
     {
-        tlvnode* child;
-        curnode = (tlvnode*) stack_pop(desStack);
-        if (!curnode)
+        log->mapping = (tlvbyte*)mmap(NULL, log->mappingsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (log->mapping == MAP_FAILED)
         {
-            break;
+            log->mapping = NULL;
+            close(fd);
+            tlv_log_destroy(log);
+            return NULL;
         }
+    }
 
-        child = curnode->firstChild;
+    close(fd);
 
-        while (child)
-        {
-            stack_push(desStack, child);
-            child = child->nextSubling;
-        }
-        free_tlv_node(curnode);
+    if (log_read_footer(log) && log_scan(log))
+    {
+        tlv_log_destroy(log);
+        return NULL;
     }
 
-    stack_destroy(desStack);
+    return log;
 }
 
-void tlv_node_set_attributes(tlv* tlv, tlvnode* node, tlv_node_attr_t attr, int value)
+void tlv_log_destroy(tlv_log* log)
 {
-    if (!tlv || !node)
+    if (!log)
     {
         return;
     }
 
-    int index_t = attr / 8;
-    int index_byte = attr % 8;
-    tlvbyte b = 0x01;
-    b = b << (7 - index_byte);
-
-    if (value == 0)
+    if (log->mapping)
     {
-        b = ~b;
-        node->a[index_t] = node->a[index_t] & b;
+        munmap(log->mapping, log->mappingsize);
     }
-    else if (value == 1)
-    {
 
-        node->a[index_t] = node->a[index_t] | b;
-    }
-    else
-    {
-        // do nothing
-    }
+    free(log->offsets);
+    free(log);
 }
 
-int tlv_node_get_attributes(const tlv* tlv, const tlvnode* node, tlv_node_attr_t attr)
+size_t tlv_log_count(const tlv_log* log)
 {
-    if (!tlv || !node)
-    {
-        return 0;
-    }
-
-    int index_t = attr / 8;
-    int index_byte = attr % 8;
-
-    tlvbyte b = 0x01;
-    b = b << (7 - index_byte);
-
-    return (node->a[index_t]) & b;
+    return log ? log->count : 0;
 }
 
-int tlv_node_add_child(tlv* tlv, tlvnode* parent, tlvnode* child)
+const tlvbyte* tlv_log_record(const tlv_log* log, size_t n, size_t* size)
 {
-    if (!tlv || !parent || !child)
+    size_t offset;
+    size_t next;
+
+    if (!log || n >= log->count)
     {
-        return -1;
+        return NULL;
     }
 
-    tlv_node_set_attributes(tlv, parent, TLV_NODE_ATTR_IS_STRUCTUAL, 1);
+    offset = log_offset(log, n);
+    next = log_offset(log, n + 1);
 
-    if (parent->v)
+    // offsets from a footer are not trusted blindly
+    if (offset > next || next > log->end)
     {
-        free(parent->v);
-        parent->v = NULL;
-        parent->length = 0;
-        tlv_node_set_l(tlv, parent, 0);
+        return NULL;
     }
 
-    tlvnode* lastChild = tlv_node_last_child(parent);
-    if (lastChild)
-    {
-        lastChild->nextSubling = child;
-        child->prevSubling = lastChild;
-        child->nextSubling = NULL;
-    }
-    else // parent without child
+    if (size)
     {
-        parent->firstChild = child;
+        *size = next - offset;
     }
 
-    child->parent = parent;
-    ++parent->childCount;
-
-    return 0;
+    return log->mapping + offset;
 }
 
-int tlv_node_remove_child(tlv* tlv, tlvnode* child)
+size_t tlv_log_load(const tlv_log* log, size_t n, tlv* tree)
 {
-    if (!tlv || !child)
+    size_t size;
+    const tlvbyte* record = tlv_log_record(log, n, &size);
+
+    if (!record || !tree)
     {
-        return -1;
+        return 0;
     }
 
-    tlvnode* parent = child->parent;
-    if (!parent)
+    return tlv_loads(tree, (tlvbyte*)record, size);
+}
+
+size_t tlv_log_find(const tlv_log* log, size_t from, const tlvbyte* tvalue, size_t tlength)
+{
+    size_t hdrsize;
+    size_t i = from;
+
+    if (!log || !tvalue)
     {
-        return -1;
+        return TLV_FLAT_NONE;
     }
 
-    tlvnode* curChild = parent->firstChild;
+    hdrsize = log->def.alength + log->def.tlength + log->def.llength;
 
-    while (curChild)
+    while (i < log->count)
     {
-        if (curChild == child)
-        {
-            if (curChild == parent->firstChild)
-            {
-                parent->firstChild = curChild->nextSubling;
-                if (curChild->nextSubling)
-                {
-                    curChild->nextSubling->prevSubling = NULL;
-                }
-            }
-            else
-            {
-                curChild->prevSubling->nextSubling = curChild->nextSubling;
-                if (curChild->nextSubling)
-                {
-                    curChild->nextSubling->prevSubling = curChild->prevSubling;
-                }
-            }
+        size_t size;
+        const tlvbyte* record;
 
-            --(parent->childCount);
-            child->parent = child->prevSubling = child->nextSubling = NULL;
+        if (log->blocks)
+        {
+            size_t b = i / log->blockrecords;
+            const tlvbyte* min = log->blocks + b * 2 * log->def.tlength;
+            const tlvbyte* max = min + log->def.tlength;
 
-            if (!parent->childCount)
+            if (log_tag_cmp(&log->def, min, tvalue, tlength) > 0
+                    || log_tag_cmp(&log->def, max, tvalue, tlength) < 0)
             {
-                tlv_node_set_attributes(tlv, parent, TLV_NODE_ATTR_IS_STRUCTUAL, 0);
-
-                parent->length = 0;
-                tlv_node_set_l(tlv, parent, 0);
+                i = (b + 1) * log->blockrecords;
+                continue;
             }
+        }
 
-            break;
+        record = tlv_log_record(log, i, &size);
+        if (record && size >= hdrsize
+                && tag_bytes_equal(&log->def, record + log->def.alength, tvalue, tlength))
+        {
+            return i;
         }
-        curChild =curChild->nextSubling;
+
+        i++;
     }
 
-    return 0;
+    return TLV_FLAT_NONE;
 }
 
+struct tlv_log_writer
+{
+    tlv def;
+    int fd;
+    int failed; // a write went wrong, appends fail from then on, reported by destroy
+    size_t* offsets;
+    size_t count;
+    size_t capacity;
+    size_t end; // file offset after the last record, buffered ones too
+    size_t blockrecords;
+    tlvbyte* blocks; // min, max tag of every block
+    size_t blockcapacity;
+    tlvbyte* buf; // records not written yet
+    size_t bufsize;
+    size_t used;
+};
+
 /*
- * calculate all the *l, length values in tlv tree
- * returns bytes of total dump size
+ * account a record of size bytes and tag tag appended at w->end
  */
-size_t tlv_layout(tlv* tlv)
+static int log_writer_note(tlv_log_writer* w, size_t size, const tlvbyte* tag)
 {
-    size_t dumplen = 0;
-    tlvnode* curnode;
-    _stack* laStack;
+    size_t tlength = w->def.tlength;
 
-    if (!tlv)
+    if (w->count == w->capacity)
     {
-        return 0;
-    }
+        size_t capacity = w->capacity ? w->capacity * 2 : 64;
+        size_t* offsets = (size_t*)realloc(w->offsets, sizeof(size_t) * capacity);
+        if (!offsets)
+        {
+            return -1;
+        }
 
-    laStack = stack_obtain(STACK_INIT_SIZE);
-    stack_push(laStack, tlv->root);
+        w->offsets = offsets;
+        w->capacity = capacity;
+    }
 
-    while (laStack->index > 0)
+    if (w->blockrecords)
     {
-        curnode = (tlvnode*) stack_pop(laStack);
+        size_t b = w->count / w->blockrecords;
+        tlvbyte* min;
+        tlvbyte* max;
 
-        if (!curnode)
+        if (b == w->blockcapacity)
         {
-            continue;
+            size_t capacity = w->blockcapacity ? w->blockcapacity * 2 : 16;
+            tlvbyte* blocks = (tlvbyte*)realloc(w->blocks, capacity * 2 * tlength);
+            if (!blocks)
+            {
+                return -1;
+            }
+
+            w->blocks = blocks;
+            w->blockcapacity = capacity;
         }
 
-        if (curnode->firstChild != NULL)
+        min = w->blocks + b * 2 * tlength;
+        max = min + tlength;
+
+        if (w->count % w->blockrecords == 0)
         {
-            curnode->length = 0;
-            curnode = curnode->firstChild;
-            while (curnode)
-            {
-                stack_push(laStack, curnode);
-                curnode = curnode->nextSubling;
-            }
+            memcpy(min, tag, tlength);
+            memcpy(max, tag, tlength);
         }
-        else 
+        else if (memcmp(tag, min, tlength) < 0)
         {
-            tlvnode* p = curnode->parent;
-            tlv_node_set_l(tlv, curnode, curnode->length);
-            while (p)
-            {
-                tlvnode* c = p->firstChild;
-                p->length = 0;
-                while (c)
-                {
-                    p->length += c->length + tlv->alength + tlv->tlength + tlv->llength;
-                    c = c->nextSubling;
-                }
-
-                tlv_node_set_l(tlv, p, p->length);
-                curnode = p;
-                p = p->parent;
-            }
+            memcpy(min, tag, tlength);
+        }
+        else if (memcmp(tag, max, tlength) > 0)
+        {
+            memcpy(max, tag, tlength);
         }
     }
 
-    stack_destroy(laStack);
-
-    dumplen =  tlv->root->length + tlv->tlength + tlv->llength;
-    tlv->dumplength = dumplen;
+    w->offsets[w->count++] = w->end;
+    w->end += size;
 
-    return dumplen;
+    return 0;
 }
 
-size_t tlv_node_read_t(const tlv* tlv, const tlvnode* node, tlvbyte* buf, size_t bufsize)
+static int log_writer_flush(tlv_log_writer* w)
 {
-    size_t size = 0;
+    size_t done = 0;
 
-    if (!tlv || !node || !buf || bufsize < 0)
+    while (done < w->used)
     {
-        return -1;
-    }
+        ssize_t n = write(w->fd, w->buf + done, w->used - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
 
-    if (tlv->tlength)
-    {
-        size = bufsize < tlv->tlength ? bufsize : tlv->tlength;
-        memcpy(buf, node->t, size);
+            w->failed = 1;
+            break;
+        }
+
+        done += n;
     }
 
-    return size;
+    w->used = 0;
+
+    return w->failed ? -1 : 0;
 }
 
-size_t tlv_node_write_t(tlv* tlv, tlvnode* node, tlvbyte* tvalue, size_t tlength)
+/*
+ * room for size more bytes in the buffer, flushed or grown as needed
+ * returns: NULL if out of memory or a write failed, now or before,
+ *          as records after lost bytes would be found at wrong offsets
+ */
+static tlvbyte* log_writer_room(tlv_log_writer* w, size_t size)
 {
-    size_t size;
+    if (w->failed)
+    {
+        return NULL;
+    }
 
-    if (!tlv || !node || !tvalue || tlength < 0)
+    if (w->used + size > w->bufsize && log_writer_flush(w) < 0)
     {
-        return 0;
+        return NULL;
     }
 
-    size = tlength < tlv->tlength? tlength : tlv->tlength;
-    memcpy(node->t, tvalue, size);
+    if (size > w->bufsize)
+    {
+        tlvbyte* buf = (tlvbyte*)realloc(w->buf, size);
+        if (!buf)
+        {
+            return NULL;
+        }
 
-    return size;
+        w->buf = buf;
+        w->bufsize = size;
+    }
+
+    return w->buf + w->used;
 }
 
-size_t tlv_node_write_v(tlv* tlv, tlvnode* node, tlvbyte* vvalue, size_t vlength)
+/*
+ * take the records of the log at path over, for w to append to
+ */
+static int log_writer_continue(tlv_log_writer* w, const char* path)
 {
+    tlv_log* log = tlv_log_obtain(&w->def, path);
     size_t i;
 
-    if (!tlv || !node || !vvalue || vlength < 0)
+    if (!log)
     {
-        return 0;
+        return -1;
     }
 
-    node->length = vlength;
-    node->v = (tlvbyte*)malloc(vlength);
+    for (i = 0; i < log->count; i++)
+    {
+        size_t size;
+        const tlvbyte* record = tlv_log_record(log, i, &size);
 
-    for (i = 0; i < vlength; i++)
+        if (!record || log_writer_note(w, size, record + w->def.alength))
+        {
+            tlv_log_destroy(log);
+            return -1;
+        }
+    }
+
+    tlv_log_destroy(log);
+
+    // footer and partial record go, new records follow the last one
+    if (truncate(path, w->end))
     {
-        node->v[i] = vvalue[i];
+        return -1;
     }
 
-    return vlength;
+    return 0;
 }
 
-
-int tlv_node_traverse(tlv* t, int (*callback)(tlv*, tlvnode*))
+tlv_log_writer* tlv_log_writer_obtain(const tlv* def, const char* path, size_t blockrecords)
 {
-    int visited = 0;
-    tlvnode* root;
-    _stack* stack;
+    tlv_log_writer* w;
+    struct stat st;
 
-    if (!t)
+    if (!def || def->varint || !path)
     {
-        return 0;
+        return NULL;
     }
 
-    root = t->root;
-
-    if (!root)
+    w = (tlv_log_writer*)calloc(1, sizeof(tlv_log_writer));
+    if (!w)
     {
-        return 0;
+        return NULL;
     }
 
-    stack = stack_obtain(STACK_INIT_SIZE);
-    stack_push(stack, (void*)root);
+    w->def = *def;
+    w->fd = -1;
+    w->blockrecords = blockrecords;
+    w->bufsize = LOG_BUF_SIZE;
+    w->buf = (tlvbyte*)malloc(w->bufsize);
 
-    while (stack_length(stack) > 0)
+    if (!w->buf
+            || (stat(path, &st) == 0 && st.st_size > 0 && log_writer_continue(w, path)))
     {
-        tlvnode* node = (tlvnode*) stack_pop(stack);
+        tlv_log_writer_destroy(w);
+        return NULL;
+    }
 
-        if (!node)
-        {
-            continue;
-        }
+    w->fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (w->fd < 0 || lseek(w->fd, w->end, SEEK_SET) < 0)
+    {
+        tlv_log_writer_destroy(w);
+        return NULL;
+    }
 
-        ++visited;
-        int visitres = 0;
+    return w;
+}
 
-        if (callback)
-        {
-            visitres = callback(t, node);
-        }
+int tlv_log_writer_destroy(tlv_log_writer* w)
+{
+    int res;
 
-        if (visitres)
-        {
-            break;
-        }
+    if (!w)
+    {
+        return -1;
+    }
+
+    if (w->fd >= 0)
+    {
+        size_t tlength = w->def.tlength;
+        size_t blocks = w->blockrecords ? (w->count + w->blockrecords - 1) / w->blockrecords : 0;
+        size_t footersize = w->count * 8 + blocks * 2 * tlength + LOG_TRAILER_SIZE;
+        tlvbyte* p = log_writer_room(w, footersize);
+        size_t i;
 
-        if (node->childCount > 0)
+        if (p)
         {
-            tlvnode* child = tlv_node_last_child(node);
-            while (child)
+            for (i = 0; i < w->count; i++)
             {
-                stack_push(stack, (void*) child);
-                child = child->prevSubling;
+                log_put64(p + i * 8, w->offsets[i]);
             }
+
+            p += w->count * 8;
+            if (blocks)
+            {
+                memcpy(p, w->blocks, blocks * 2 * tlength);
+                p += blocks * 2 * tlength;
+            }
+
+            memcpy(p, LOG_MAGIC, 8);
+            log_put64(p + 8, w->count);
+            log_put64(p + 16, w->blockrecords);
+            log_put64(p + 24, tlength);
+            log_put64(p + 32, w->end);
+
+            w->used += footersize;
+        }
+        else
+        {
+            w->failed = 1;
         }
+
+        log_writer_flush(w);
+        close(w->fd);
     }
 
-    if (stack)
+    res = w->failed ? -1 : 0;
+
+    free(w->buf);
+    free(w->blocks);
+    free(w->offsets);
+    free(w);
+
+    return res;
+}
+
+size_t tlv_log_append(tlv_log_writer* w, tlv* tree)
+{
+    size_t size;
+    tlvbyte* p;
+
+    if (!w || !tree || !tree->root
+            || tree->alength != w->def.alength
+            || tree->tlength != w->def.tlength
+            || tree->llength != w->def.llength
+            || tree->byteprio != w->def.byteprio
+            || tree->varint != w->def.varint)
     {
-        stack_destroy(stack);
+        return TLV_FLAT_NONE;
     }
 
-    return visited;
+    size = tlv_layout(tree);
+    p = log_writer_room(w, size);
+
+    if (!p || tlv_dumps(tree, p, size) != size || log_writer_note(w, size, p + w->def.alength))
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    w->used += size;
+
+    return w->count - 1;
+}
+
+size_t tlv_log_append_bytes(tlv_log_writer* w, const tlvbyte* bytes, size_t size)
+{
+    size_t hdrsize;
+    tlvbyte* p;
+
+    if (!w || !bytes)
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    // exactly one message, as found by its root l
+    hdrsize = w->def.alength + w->def.tlength + w->def.llength;
+    if (size < hdrsize
+            || codec_lookup(&w->def)->get_length(&w->def, bytes + w->def.alength + w->def.tlength) != size - hdrsize)
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    p = log_writer_room(w, size);
+    if (!p)
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    memcpy(p, bytes, size);
+    if (log_writer_note(w, size, p + w->def.alength))
+    {
+        return TLV_FLAT_NONE;
+    }
+
+    w->used += size;
+
+    return w->count - 1;
 }
 
+size_t tlv_log_writer_count(const tlv_log_writer* w)
+{
+    return w ? w->count : 0;
+}
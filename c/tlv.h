@@ -28,6 +28,7 @@
 #define __TLV_H
 
 #include <stdlib.h>
+#include <sys/uio.h>
 
 
 // default lengths the attribute, tag and length
@@ -46,6 +47,28 @@ typedef enum {
 } tlv_byte_prio_order_t;
 
 
+/*
+ * varint: bits of tlv->varint, fields encoded with variable length.
+ * a tree keeps tlength bytes of tag in memory either way, and its
+ * lengths are not capped by llength. dumps and loads of the tree
+ * take the encoding into account, the functions working on encoded
+ * bytes by themselves (flat, builder, decoder, validate, find_path,
+ * batch, parallel loads, dumpv, template, frozen, log) refuse it.
+ */
+typedef enum {
+    TLV_VARINT_NONE = 0,    // a, t, l of alength, tlength, llength bytes
+    TLV_VARINT_T = 1,       // t as a varint byte count, then the tag without its zero padding
+    TLV_VARINT_L = 2        // l as a varint, 7 bits a byte, low bits first
+} tlv_varint_t;
+
+
+typedef enum {
+    TLV_LOAD_COPY = 0,      // tlv_loads copies every field out of the bytes
+    TLV_LOAD_VIEW = 1,      // tlv_loads points a, t, l, v into the bytes, see tlv_loads
+    TLV_LOAD_LAZY = 2       // as TLV_LOAD_VIEW, children decoded on first access
+} tlv_load_mode_t;
+
+
 typedef struct tlvnode {
     tlvbyte* a;
     tlvbyte* t;
@@ -63,12 +86,71 @@ typedef struct tlvnode {
 
     struct tlvnode* parent;
 
+    /*
+     * children of a node loaded with TLV_LOAD_LAZY are not there until
+     * materialized, reach them through tlv_node_first_child()
+     */
     size_t childCount;
     struct tlvnode* firstChild;
+    struct tlvnode* lastChild;
     struct tlvnode* nextSubling;
     struct tlvnode* prevSubling;
+
+    /*
+     * dirty list: children whose length changed since the last
+     * tlv_layout, so layout visits these paths only
+     */
+    struct tlvnode* dirtyFirst;
+    struct tlvnode* dirtyNext;
+    struct tlvnode* dirtyPrev;
+
+    /*
+     * flags: internal bookkeeping bits (storage ownership etc.)
+     * maintained by the tlv functions, should not be touched
+     */
+    unsigned int flags;
 } tlvnode;
 
+/*
+ * arena: large chunks that back every node and field buffer
+ * of one tlv, see tlv_use_arena()
+ */
+struct tlv_arena;
+
+/*
+ * codec: header kernels specialized for one geometry, internal
+ */
+struct tlv_codec;
+
+/*
+ * index: hash index from tag to nodes, see tlv_use_index()
+ */
+struct tlv_index;
+
+/*
+ * stats: performance counters of one tlv.
+ * they are kept only when the library is built with TLV_ENABLE_STATS
+ * defined (make STATS=1), and cost nothing otherwise.
+ */
+typedef struct tlv_stats {
+    size_t nodescreated;
+    size_t nodesdestroyed;      // by tlv_node_destroy, arena nodes go uncounted
+    size_t allocs;              // allocation calls for nodes and fields, arena ones too
+    size_t allocbytes;
+    size_t loadbytes;           // bytes copied out of loaded bytes
+    size_t dumpbytes;           // bytes written by dumps
+    size_t layouts;             // tlv_layout passes
+    size_t layoutnodes;         // nodes whose l was rewritten by layout
+    size_t peakdepth;           // deepest nesting met traversing or dumping
+
+    // nanoseconds spent in each function
+    unsigned long long loadsns;
+    unsigned long long dumpsns;
+    unsigned long long layoutns;
+    unsigned long long traversens;
+    unsigned long long destroyns;
+} tlv_stats;
+
 
 typedef struct tlv {
     tlvnode* root;
@@ -79,15 +161,47 @@ typedef struct tlv {
 
     tlv_byte_prio_order_t byteprio;
 
+    int varint; // tlv_varint_t bits, TLV_VARINT_NONE by default
+
     size_t dumplength; // how much bytes does it take when tlv was dumpped to buffer
 
+    struct tlv_arena* arena; // NULL unless tlv_use_arena() was invoked
+
+    tlv_load_mode_t loadmode; // how tlv_loads fills nodes, TLV_LOAD_COPY by default
+
+    // 1 to use TLV_NODE_ATTR_IS_COMPRESSED, both to write and to read
+    // compressed values. 0 by default, the bit is left alone then
+    int compress;
+
+    // with compress on, tlv_node_write_v compresses leaf values of this
+    // many bytes or more, 0 by default for never
+    size_t compressmin;
+
+    // header kernels picked for the geometry above, internal
+    const struct tlv_codec* codec;
+
+    // file mapping the tree borrows from, see tlv_load_file
+    tlvbyte* mapping;
+    size_t mappingsize;
+
+    struct tlv_index* index; // NULL unless tlv_use_index() was invoked
+
+#ifdef TLV_ENABLE_STATS
+    tlv_stats stats; // see tlv_stats_snapshot
+#endif
+
 } tlv;
 
 
 typedef enum tlv_node_attr {
     // when set to 0, this node has no child
     // if node contains child, it should have no value
-    TLV_NODE_ATTR_IS_STRUCTUAL          =       0x02
+    TLV_NODE_ATTR_IS_STRUCTUAL          =       0x02,
+    // when set to 1 and tlv->compress is on, v of this leaf is
+    // compressed: original length in 4 bytes LSB first, then an LZ4
+    // block. v and length hold this encoded form, which is kept through
+    // dumps and loads, read the value with tlv_node_read_v
+    TLV_NODE_ATTR_IS_COMPRESSED         =       0x03
 } tlv_node_attr_t;
  
 
@@ -97,11 +211,35 @@ typedef enum tlv_node_attr {
 tlv* tlv_obtain();
 void tlv_destroy(tlv* tlv);
 
+/*
+ * switch tlv into arena mode.
+ * all nodes and field buffers obtained afterwards are carved from
+ * chunks of chunksize bytes (0 for default), and are released all at
+ * once by tlv_destroy, without walking the tree.
+ * tlv_node_destroy does nothing on arena nodes.
+ *
+ * *NOTICE: should be invoked before any node of tlv is obtained
+ * returns: 0 if succeed
+ */
+int tlv_use_arena(tlv* tlv, size_t chunksize);
+
 /*
  * load bytes into tlv node tree.
  * defination for tlv should be set into original tlv struct.
  * if succeed, tlv node tree should be set to tlv->root.
- * returns how much bytes was handled in bytes buffer.
+ * returns how much bytes was handled in bytes buffer,
+ * 0 if a node does not fit in its parent or in size.
+ * see tlv_validate to check untrusted bytes before loading.
+ *
+ * with tlv->loadmode set to TLV_LOAD_VIEW, nodes borrow a, t, l, v
+ * straight from bytes instead of copying them, so bytes should stay
+ * alive and unchanged until the tree is destroyed.
+ * node functions copy a borrowed field out before writing to it.
+ *
+ * with tlv->loadmode set to TLV_LOAD_LAZY, only root header is decoded.
+ * children of a constructed node are decoded on first access, and
+ * untouched subtrees are skipped by their l. bytes should stay alive
+ * as for TLV_LOAD_VIEW.
  */
 size_t tlv_loads(tlv* tlv, tlvbyte* bytes, size_t size);
 
@@ -111,16 +249,111 @@ size_t tlv_loads(tlv* tlv, tlvbyte* bytes, size_t size);
  */
 size_t tlv_dumps(tlv* tlv, tlvbyte* buf, size_t bufsize);
 
+/*
+ * dump tlv struct as an iovec array, ready for writev or sendmsg.
+ * headers, and values up to a few dozen bytes, are packed into scratch,
+ * iov entries of larger values point straight at node v, which should
+ * stay unchanged while iov is in use. values are not copied.
+ * tlv_layout should be invoked before, as for tlv_dumps.
+ * scratch of tlv->dumplength bytes and 2 * node count + 1 iov entries
+ * are always enough.
+ * iovcount: how many entries of iov were filled
+ * returns byte length, 0 if iov or scratch is too small
+ */
+size_t tlv_dumpv(tlv* tlv, struct iovec* iov, size_t iovsize, size_t* iovcount,
+                 tlvbyte* scratch, size_t scratchsize);
+
+/*
+ * load tlv from file, decoding straight from a memory mapping of it.
+ * with tlv->loadmode set to TLV_LOAD_VIEW the tree borrows from the
+ * mapping, which is then released by tlv_destroy.
+ * returns how much bytes was handled, 0 if failed.
+ */
+size_t tlv_load_file(tlv* tlv, const char* path);
+
+/*
+ * dump tlv into file, which is sized up front and written
+ * through a memory mapping, no dump buffer is allocated.
+ * returns byte length once the file is synced, 0 if failed.
+ */
+size_t tlv_dump_file(tlv* tlv, const char* path);
+
+/*
+ * check that bytes hold exactly one well formed message of geometry
+ * (alength, tlength, llength, byteprio), without building any tree.
+ * every node should fit in its parent, children of a constructed node
+ * should add up to its l exactly, and bytes should end where root does.
+ * payload is skipped by l and never read, so the cost goes with the
+ * node count, not the byte count. it is meant to run on untrusted bytes
+ * before tlv_loads and friends allocate anything for them.
+ * erroffset (optional): where the first bad header is, or where bytes
+ *                       go on after root
+ * returns: byte length of the message, 0 if invalid
+ */
+size_t tlv_validate(const tlvbyte* bytes, size_t size, const tlv* geometry, size_t* erroffset);
+
+/*
+ * one step of a path for tlv_find_path
+ */
+typedef struct tlv_path_step {
+    const tlvbyte* t;   // tag to match, zero padded to tlength, NULL matches any tag
+    size_t tlength;
+    size_t nth;         // take the nth match among the sublings, 0 for the first
+} tlv_path_step;
+
+/*
+ * find a node by path straight in encoded bytes, without loading them.
+ * first step picks among the top level nodes of bytes (the root),
+ * each following step among the children of the previous match.
+ * sublings that do not match are hopped over by their l, so only
+ * headers along the way are read. geometry gives alength, tlength,
+ * llength and byteprio, nothing is allocated.
+ *
+ * voffset, vlength (optional) get where the value of the matched node
+ * is in bytes, for a constructed node that is all of its children.
+ * returns: 0 if found, 1 if no node matches path,
+ *          -1 if the bytes walked are malformed
+ */
+int tlv_find_path(const tlvbyte* bytes, size_t size, const tlv* geometry,
+                  const tlv_path_step* path, size_t pathlength,
+                  size_t* voffset, size_t* vlength);
+
 /*
  * calculate all the *l, length values in tlv tree
  * returns bytes of total dump size
  *
+ * node functions keep length of every ancestor up to date as they
+ * edit the tree, and mark the changed paths dirty. layout rewrites
+ * *l on those paths only, so it costs O(depth) after a small edit.
+ *
  * * NOTICE: should be invoked before dump tlv to buffer
  * * OR: set tlv->autolayout = 1, then the tlv_layout
  *       will be invoked each time the length might be changed
  */
 size_t tlv_layout(tlv* tlv);
 
+/*
+ * keep a hash index from tag to nodes of tlv, for
+ * tlv_node_find_child and tlv_node_find_descendants.
+ * node functions keep it up to date as the tree is edited,
+ * it covers nodes reachable from root. should the index fail to
+ * take a node, it is dropped and lookups walk the tree again.
+ * returns: 0 if succeed
+ */
+int tlv_use_index(tlv* tlv);
+
+/*
+ * copy performance counters of tlv into stats
+ * returns: 0 if succeed, -1 if the library is built
+ *          without TLV_ENABLE_STATS
+ */
+int tlv_stats_snapshot(const tlv* tlv, tlv_stats* stats);
+
+/*
+ * zero performance counters of tlv
+ */
+void tlv_stats_reset(tlv* tlv);
+
 /*
  * specify tree entrance for tlv
  */
@@ -138,10 +371,64 @@ int tlv_node_count(const tlv* tlv);
 tlvnode* tlv_node_obtain(tlv* tlv);
 void tlv_node_destroy(tlv* tlv, tlvnode* node);
 
+/*
+ * decode children of a lazy loaded node, one level down.
+ * node functions and traversing call this on their own.
+ * returns: 0 if succeed
+ */
+int tlv_node_materialize(tlv* tlv, tlvnode* node);
+
+/*
+ * returns: first child of node, materialized if needed
+ */
+tlvnode* tlv_node_first_child(tlv* tlv, tlvnode* node);
+
+/*
+ * find direct child of parent by tag, tag is zero padded to tlength.
+ * O(1) with tlv_use_index, otherwise walks the children
+ * returns: the first matching child, NULL if none or if the
+ *          children of a lazy parent cannot be decoded
+ */
+tlvnode* tlv_node_find_child(tlv* tlv, tlvnode* parent, const tlvbyte* tvalue, size_t tlength);
+
+/*
+ * find nodes by tag at any depth under node, node excluded.
+ * needs tlv_use_index. up to foundsize of them are stored in found,
+ * in no particular order
+ * returns: count of matching nodes, 0 if a lazy part under node
+ *          cannot be decoded
+ */
+size_t tlv_node_find_descendants(tlv* tlv, tlvnode* node, const tlvbyte* tvalue, size_t tlength,
+                                 tlvnode** found, size_t foundsize);
+
 size_t tlv_node_read_t(const tlv* tlv, const tlvnode* node, tlvbyte* buf, size_t bufsize);
 size_t tlv_node_write_t(tlv* tlv, tlvnode* node, tlvbyte* tvalue, size_t tlength);
+
+/*
+ * write value of node, compressed if tlv->compress and compressmin
+ * ask for it and it comes out smaller
+ */
 size_t tlv_node_write_v(tlv* tlv, tlvnode* node, tlvbyte* vvalue, size_t vlength);
 
+/*
+ * returns: length of the value of node, as it was before compression,
+ *          -1 if the compressed value claims more than it can hold
+ */
+size_t tlv_node_value_length(const tlv* tlv, const tlvnode* node);
+
+/*
+ * copy the value of node into buf, decompressed if compressed,
+ * the node itself is left as it is
+ * returns: value length, -1 if buf is too small or the value is corrupt
+ */
+size_t tlv_node_read_v(const tlv* tlv, const tlvnode* node, tlvbyte* buf, size_t bufsize);
+
+/*
+ * replace the compressed value of node with the decompressed one
+ * returns: 0 if succeed or not compressed, -1 if the value is corrupt
+ */
+int tlv_node_decompress(tlv* tlv, tlvnode* node);
+
 /*
  * set attribute bit value
  * attr: which bit
@@ -191,5 +478,713 @@ int tlv_node_traverse(tlv* t, int (*callback)(tlv*, tlvnode*));
 
 
 ////////////////////////////// TLV NODE FUNCTIONS BELOW //////////////////////////////
+////////////////////////////// TLV DECODER FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * decoder: resumable tlv_loads for bytes arriving in pieces.
+ * it keeps the partially built tree and its nesting between feeds,
+ * so no byte is looked at twice.
+ */
+typedef struct tlv_decoder tlv_decoder;
+
+typedef enum {
+    TLV_DECODE_ERROR = -1,      // bytes do not form a valid tlv
+    TLV_DECODE_NEED_MORE = 0,   // message not complete yet, see tlv_decoder_need
+    TLV_DECODE_COMPLETE = 1     // tlv->root holds the whole message
+} tlv_decode_status_t;
+
+/*
+ * obtain a decoder which builds the next message into tlv.
+ * fields are always copied, the fed bytes need not stay alive.
+ */
+tlv_decoder* tlv_decoder_obtain(tlv* tlv);
+void tlv_decoder_destroy(tlv_decoder* dec);
+
+/*
+ * start over with an empty tlv, for decoding the next message
+ */
+void tlv_decoder_reset(tlv_decoder* dec, tlv* tlv);
+
+/*
+ * feed next piece of bytes.
+ * bytes beyond the end of the message are left alone,
+ * consumed (optional) tells how much of bytes was taken.
+ * returns: decode status after this piece
+ */
+tlv_decode_status_t tlv_decoder_feed(tlv_decoder* dec, const tlvbyte* bytes, size_t size, size_t* consumed);
+
+/*
+ * returns: how much more bytes are needed at least to complete
+ *          the message, 0 once complete or failed
+ */
+size_t tlv_decoder_need(const tlv_decoder* dec);
+
+
+////////////////////////////// TLV DECODER FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV FLAT FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * flat: index based tlv tree, with nodes kept in preorder in parallel
+ * arrays instead of linked tlvnode structs.
+ * children of constructed node i start from i + 1, each child c is
+ * followed by subling next[c], and the subtree of i ends right before
+ * next[i].
+ */
+typedef struct tlv_flat {
+    tlv* tlv;           // definition: alength, tlength, llength, byteprio
+
+    size_t count;       // nodes in use
+    size_t capacity;    // nodes allocated
+
+    tlvbyte** h;        // header (a, t, l bytes back to back) of each node
+    tlvbyte** v;        // value of each leaf, NULL for constructed nodes
+    size_t* length;     // value length, or content length of constructed node
+    size_t* next;       // index right after the subtree of each node
+    size_t* parent;     // index of parent, TLV_FLAT_NONE for root
+
+    tlvbyte* data;      // bytes owned by flat, NULL when they are borrowed
+} tlv_flat;
+
+#define TLV_FLAT_NONE ((size_t)-1)
+
+tlv_flat* tlv_flat_obtain(tlv* tlv);
+void tlv_flat_destroy(tlv_flat* flat);
+
+/*
+ * load bytes into flat tree in a single pass.
+ * headers and values are not copied, bytes should stay alive
+ * and unchanged as long as flat uses them.
+ * returns how much bytes was handled, 0 if bytes are malformed.
+ */
+size_t tlv_flat_loads(tlv_flat* flat, tlvbyte* bytes, size_t size);
+
+/*
+ * flatten node tree of tlv, headers and values are copied into flat
+ * returns: 0 if succeed
+ */
+int tlv_flat_from_tree(tlv_flat* flat, tlv* tlv);
+
+/*
+ * returns: none 0 if node index is a constructed one
+ */
+int tlv_flat_is_structual(const tlv_flat* flat, size_t index);
+
+/*
+ * set value of leaf index. vvalue is borrowed, not copied.
+ *
+ * *NOTICE: lengths of ancestors are stale until tlv_flat_layout
+ * returns: 0 if succeed
+ */
+int tlv_flat_write_v(tlv_flat* flat, size_t index, tlvbyte* vvalue, size_t vlength);
+
+/*
+ * calculate content lengths of all constructed nodes, bottom up
+ * returns bytes of total dump size
+ */
+size_t tlv_flat_layout(tlv_flat* flat);
+
+/*
+ * dump flat tree into bytes, in the same format as tlv_dumps.
+ * run tlv_flat_layout first after tlv_flat_write_v
+ * returns byte length, 0 if buf is too small
+ */
+size_t tlv_flat_dumps(tlv_flat* flat, tlvbyte* buf, size_t bufsize);
+
+/*
+ * visit nodes in preorder, callback gets the node index
+ * and returns 0 if you want the traversing continue
+ * returns: total count of visited nodes
+ */
+int tlv_flat_traverse(tlv_flat* flat, int (*callback)(tlv_flat*, size_t));
+
+
+////////////////////////////// TLV FLAT FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV BUILDER FUNCTIONS BELOW //////////////////////////////
+
+#define TLV_BUILDER_MAX_DEPTH 32
+
+/*
+ * builder: encode a message straight into a caller buffer in one pass,
+ * without any node tree or allocation.
+ * l of a constructed node is patched in when the node is ended.
+ */
+typedef struct tlv_builder {
+    const tlv* tlv;     // definition: alength, tlength, llength, byteprio
+    const struct tlv_codec* codec; // internal
+
+    tlvbyte* buf;
+    size_t bufsize;
+    size_t index;       // bytes written so far
+
+    size_t depth;       // constructed nodes begun but not ended yet
+    size_t open[TLV_BUILDER_MAX_DEPTH]; // header offsets of those nodes
+
+    int error;          // none 0 once any call failed, sticks till init
+} tlv_builder;
+
+void tlv_builder_init(tlv_builder* b, const tlv* tlv, tlvbyte* buf, size_t bufsize);
+
+/*
+ * begin a constructed node, following calls add its children
+ * returns: 0 if succeed
+ */
+int tlv_builder_begin(tlv_builder* b, const tlvbyte* tvalue, size_t tlength);
+
+/*
+ * add a leaf node
+ * returns: 0 if succeed
+ */
+int tlv_builder_value(tlv_builder* b, const tlvbyte* tvalue, size_t tlength,
+                      const tlvbyte* vvalue, size_t vlength);
+
+/*
+ * end the latest begun constructed node, and patch its l
+ * returns: 0 if succeed
+ */
+int tlv_builder_end(tlv_builder* b);
+
+/*
+ * returns: byte length of the message in buf,
+ *          0 if any call failed or some node is not ended
+ */
+size_t tlv_builder_finish(tlv_builder* b);
+
+
+////////////////////////////// TLV BUILDER FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV BATCH FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * batch: decodes back to back messages of one buffer into a set of
+ * trees. all trees share one arena and one nesting stack, which are
+ * kept between loads, so a steady stream of batches settles down to
+ * no allocation at all.
+ */
+typedef struct tlv_batch tlv_batch;
+
+/*
+ * obtain a batch decoding messages as defined by tlv: alength,
+ * tlength, llength, byteprio, loadmode and compress. tlv should
+ * outlive batch.
+ * chunksize: arena chunk size, 0 for default
+ */
+tlv_batch* tlv_batch_obtain(const tlv* tlv, size_t chunksize);
+void tlv_batch_destroy(tlv_batch* batch);
+
+/*
+ * decode every complete message in bytes, one tree each.
+ * trees of the previous load are dropped first.
+ * stops at a trailing partial message, so bytes from the returned
+ * offset on can be loaded again once more of them arrived.
+ * it stops at a malformed message too, which no more bytes will fix:
+ * malformed: set to 1 if that is why it stopped, 0 otherwise, may be NULL
+ * with loadmode TLV_LOAD_VIEW or TLV_LOAD_LAZY, bytes should stay
+ * alive until the next load.
+ * returns: how much bytes was consumed, up to the malformed message
+ */
+size_t tlv_batch_loads(tlv_batch* batch, tlvbyte* bytes, size_t size, int* malformed);
+
+/*
+ * returns: how many trees the last load decoded
+ */
+size_t tlv_batch_count(const tlv_batch* batch);
+
+/*
+ * returns: tree i of the last load, NULL if out of range.
+ * trees belong to batch and are valid until the next load,
+ * they should not be passed to tlv_destroy
+ */
+tlv* tlv_batch_tree(tlv_batch* batch, size_t i);
+
+
+////////////////////////////// TLV BATCH FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV PARALLEL FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * pool: worker threads for the parallel functions below.
+ * a call splits its work into tasks and hands each worker a range
+ * of them, a worker that runs dry steals half of what another one
+ * has left. the calling thread works as one of the workers.
+ * a pool runs one call at a time.
+ */
+typedef struct tlv_pool tlv_pool;
+
+/*
+ * threadcount: workers including the calling thread, 0 for one per cpu
+ */
+tlv_pool* tlv_pool_obtain(size_t threadcount);
+void tlv_pool_destroy(tlv_pool* pool);
+
+/*
+ * decode back to back messages of bytes on the workers of pool.
+ * messages are found by skipping over root l, then decoded in
+ * parallel, each into a tlv of its own as defined by def
+ * (alength, tlength, llength, byteprio, loadmode, compress, arena
+ * or not).
+ * trees: gets up to treesize trees in message order, which the
+ *        caller should tlv_destroy
+ * count: how many trees were decoded
+ * malformed: as tlv_batch_loads, may be NULL
+ * returns: how much bytes was consumed, it stops at a trailing
+ *          partial message or at a malformed one, as tlv_batch_loads
+ */
+size_t tlv_parallel_loads(tlv_pool* pool, const tlv* def, tlvbyte* bytes, size_t size,
+                          tlv** trees, size_t treesize, size_t* count, int* malformed);
+
+/*
+ * as tlv_loads, for one large tree. the calling thread decodes the
+ * top levels, and subtrees below them go to the workers of pool.
+ * small trees and TLV_LOAD_LAZY are loaded by tlv_loads.
+ * returns: how much bytes was handled, 0 if bytes are malformed
+ */
+size_t tlv_parallel_loads_tree(tlv_pool* pool, tlv* tlv, tlvbyte* bytes, size_t size);
+
+/*
+ * as tlv_layout and tlv_dumps in one go, with the same bytes out.
+ * every subtree gets its offset in buf from the lengths before it,
+ * then the workers of pool dump disjoint subtrees at the same time.
+ * small trees are dumped by tlv_dumps.
+ * returns byte length, which is more than bufsize if buf is too small
+ */
+size_t tlv_parallel_dumps(tlv_pool* pool, tlv* tlv, tlvbyte* buf, size_t bufsize);
+
+
+////////////////////////////// TLV PARALLEL FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV TEMPLATE FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * template: a message compiled once into its encoded bytes, with a
+ * table of slots for the leaves that change between sends.
+ * a value of the same size is patched into the bytes in place,
+ * one of another size moves the bytes behind it and rewrites the l
+ * of the leaf and its ancestors only, no tree is walked.
+ */
+typedef struct tlv_template tlv_template;
+
+/*
+ * compile tree of tlv into a template, tlv_layout is invoked on it.
+ * slots: leaves of the tree, slot i of the template is slots[i].
+ * tlv may be changed or destroyed afterwards.
+ */
+tlv_template* tlv_template_obtain(tlv* tlv, tlvnode** slots, size_t slotcount);
+void tlv_template_destroy(tlv_template* tpl);
+
+/*
+ * set value of a slot, vvalue is copied
+ * returns: 0 if succeed, -1 if some l on the path can not hold
+ *          the new length
+ */
+int tlv_template_set(tlv_template* tpl, size_t slot, const tlvbyte* vvalue, size_t vlength);
+
+/*
+ * returns: encoded message, valid until the next tlv_template_set
+ * size: its byte length
+ */
+const tlvbyte* tlv_template_bytes(const tlv_template* tpl, size_t* size);
+
+
+////////////////////////////// TLV TEMPLATE FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV FROZEN FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * frozen: read only snapshot of a tree, compacted into one block with
+ * its encoded bytes and preorder node arrays, as tlv_flat has them.
+ * it is never changed after tlv_freeze, so any number of threads may
+ * read it at once. the read functions below take no lock and
+ * allocate nothing. nodes are indexes, root is 0, TLV_FLAT_NONE is
+ * returned where there is no node.
+ * a snapshot is reference counted, the last release frees it.
+ */
+typedef struct tlv_frozen tlv_frozen;
+
+/*
+ * freeze tree of tlv, tlv_layout is invoked on it.
+ * tlv may be changed or destroyed afterwards.
+ * returns: snapshot with one reference, NULL if failed
+ */
+tlv_frozen* tlv_freeze(tlv* tlv);
+
+/*
+ * take one more reference, for handing the snapshot to another thread
+ * returns: f
+ */
+tlv_frozen* tlv_frozen_retain(tlv_frozen* f);
+void tlv_frozen_release(tlv_frozen* f);
+
+size_t tlv_frozen_count(const tlv_frozen* f);
+
+/*
+ * returns: encoded message, for tlv_find_path and the like
+ * size: its byte length
+ */
+const tlvbyte* tlv_frozen_bytes(const tlv_frozen* f, size_t* size);
+
+/*
+ * returns: definition of the snapshot: alength, tlength, llength, byteprio
+ */
+const tlv* tlv_frozen_geometry(const tlv_frozen* f);
+
+size_t tlv_frozen_parent(const tlv_frozen* f, size_t index);
+size_t tlv_frozen_first_child(const tlv_frozen* f, size_t index);
+size_t tlv_frozen_next_subling(const tlv_frozen* f, size_t index);
+
+/*
+ * returns: none 0 if node index is a constructed one
+ */
+int tlv_frozen_is_structual(const tlv_frozen* f, size_t index);
+
+/*
+ * returns: tag of node index, tlength bytes
+ */
+const tlvbyte* tlv_frozen_t(const tlv_frozen* f, size_t index);
+
+/*
+ * returns: value of node index, the encoded children for a
+ *          constructed one
+ * length (optional): its byte length
+ */
+const tlvbyte* tlv_frozen_v(const tlv_frozen* f, size_t index, size_t* length);
+
+/*
+ * find direct child of node index by tag, tag is zero padded to tlength
+ * returns: the first matching child
+ */
+size_t tlv_frozen_find_child(const tlv_frozen* f, size_t index, const tlvbyte* tvalue, size_t tlength);
+
+/*
+ * visit nodes in preorder, callback gets the node index and arg,
+ * and returns 0 if you want the traversing continue
+ * returns: total count of visited nodes
+ */
+int tlv_frozen_traverse(const tlv_frozen* f, int (*callback)(const tlv_frozen*, size_t, void*), void* arg);
+
+
+////////////////////////////// TLV FROZEN FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV AIO FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * aio: asynchronous file load and dump.
+ * operations are queued, then handed over in one batch to io_uring,
+ * or to a few threads doing blocking io where io_uring is missing.
+ * completions are reaped by tlv_aio_poll, which runs the callbacks
+ * in the calling thread. an aio is used by one thread at a time.
+ */
+typedef struct tlv_aio tlv_aio;
+
+typedef enum {
+    TLV_AIO_AUTO = 0,       // io_uring if the kernel has it, threads otherwise
+    TLV_AIO_URING = 1,      // io_uring or nothing
+    TLV_AIO_THREADS = 2     // blocking io on threads
+} tlv_aio_backend_t;
+
+/*
+ * tree: loaded tree, which the callback should tlv_destroy,
+ *       NULL if failed
+ * error: 0 if succeed, an errno value otherwise
+ */
+typedef void (*tlv_aio_loaded)(tlv* tree, const char* path, int error, void* arg);
+typedef void (*tlv_aio_dumped)(const char* path, int error, void* arg);
+
+/*
+ * depth: operations in flight at once, 0 for a default
+ * returns: NULL if backend is not available
+ */
+tlv_aio* tlv_aio_obtain(size_t depth, tlv_aio_backend_t backend);
+
+/*
+ * waits for every queued operation and runs its callback first
+ */
+void tlv_aio_destroy(tlv_aio* aio);
+
+tlv_aio_backend_t tlv_aio_backend(const tlv_aio* aio);
+
+/*
+ * queue a load of the file at path into a tree of its own as defined
+ * by def (alength, tlength, llength, byteprio, loadmode, compress,
+ * arena or not).
+ * the whole file should be one message. with TLV_LOAD_VIEW or
+ * TLV_LOAD_LAZY the tree borrows the read buffer, which goes away
+ * with tlv_destroy, as for tlv_load_file.
+ * returns: 0 if queued, -1 if path cannot be opened, callback is not
+ *          invoked then
+ */
+int tlv_aio_load(tlv_aio* aio, const tlv* def, const char* path, tlv_aio_loaded callback, void* arg);
+
+/*
+ * queue a write of size bytes of buf into the file at path,
+ * which is created or truncated. buf should stay unchanged until
+ * the callback is invoked.
+ * returns: 0 if queued, -1 if path cannot be opened
+ */
+int tlv_aio_dump(tlv_aio* aio, const char* path, const tlvbyte* buf, size_t size,
+                 tlv_aio_dumped callback, void* arg);
+
+/*
+ * as tlv_aio_dump, for the output of tlv_dumpv. iov is copied, the
+ * memory it points at should stay unchanged until the callback.
+ */
+int tlv_aio_dumpv(tlv_aio* aio, const char* path, const struct iovec* iov, size_t iovcount,
+                  tlv_aio_dumped callback, void* arg);
+
+/*
+ * hand queued operations over, as many as depth allows, without waiting.
+ * returns: count of operations handed over, -1 if failed
+ */
+int tlv_aio_submit(tlv_aio* aio);
+
+/*
+ * submit, then reap completed operations and run their callbacks,
+ * waiting until at least min of them completed, 0 never waits.
+ * returns: count of operations completed, -1 if failed
+ */
+int tlv_aio_poll(tlv_aio* aio, size_t min);
+
+/*
+ * returns: count of operations queued or in flight
+ */
+size_t tlv_aio_pending(const tlv_aio* aio);
+
+
+////////////////////////////// TLV AIO FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV LOG FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * log: file of dumped trees appended back to back, followed by a footer
+ * with the offset of every record and, optionally, the smallest and
+ * largest root tag of every block of records:
+ *
+ *   records | offsets, 8 bytes LSB each | min, max tag per block | trailer
+ *
+ * the trailer of 40 bytes is a magic, record count, records per block,
+ * tlength and footer offset, 8 bytes LSB each. the footer is written by
+ * tlv_log_writer_destroy, a log without one, say of a writer still at
+ * work or killed, is still read by scanning over root l.
+ */
+typedef struct tlv_log_writer tlv_log_writer;
+typedef struct tlv_log tlv_log;
+
+/*
+ * open the log at path for appending, records should be of the
+ * geometry of def. an existing log is continued, its footer is
+ * dropped and written again on destroy, a trailing partial record
+ * is cut off.
+ * blockrecords: records per block with min, max tag, 0 for none
+ */
+tlv_log_writer* tlv_log_writer_obtain(const tlv* def, const char* path, size_t blockrecords);
+
+/*
+ * write what is buffered and the footer, then close the file
+ * returns: 0 if succeed, -1 if any write failed
+ */
+int tlv_log_writer_destroy(tlv_log_writer* w);
+
+/*
+ * append tree as one record, tlv_layout is invoked on it.
+ * tree should be defined as the log is, varint trees are refused.
+ * records are buffered, and written as the buffer fills up.
+ * returns: index of the record, TLV_FLAT_NONE if failed
+ */
+size_t tlv_log_append(tlv_log_writer* w, tlv* tree);
+
+/*
+ * append one message already dumped, size should be its exact length
+ */
+size_t tlv_log_append_bytes(tlv_log_writer* w, const tlvbyte* bytes, size_t size);
+
+/*
+ * returns: count of records appended, including the ones found
+ *          in the log when it was opened
+ */
+size_t tlv_log_writer_count(const tlv_log_writer* w);
+
+/*
+ * open the log at path for reading, it is memory mapped.
+ * geometry of the records is taken from def.
+ */
+tlv_log* tlv_log_obtain(const tlv* def, const char* path);
+void tlv_log_destroy(tlv_log* log);
+
+size_t tlv_log_count(const tlv_log* log);
+
+/*
+ * returns: record n in place, size gets its length, NULL if out of range
+ */
+const tlvbyte* tlv_log_record(const tlv_log* log, size_t n, size_t* size);
+
+/*
+ * load record n into tree as tlv_loads, with TLV_LOAD_VIEW or
+ * TLV_LOAD_LAZY the tree borrows from log, which should outlive it
+ * returns: how much bytes was handled, 0 if failed
+ */
+size_t tlv_log_load(const tlv_log* log, size_t n, tlv* tree);
+
+/*
+ * find the first record from index from on whose root tag is tvalue,
+ * zero padded to tlength. blocks whose tag range leaves it out
+ * are skipped without reading their records.
+ * returns: index of the record, TLV_FLAT_NONE if there is none
+ */
+size_t tlv_log_find(const tlv_log* log, size_t from, const tlvbyte* tvalue, size_t tlength);
+
+
+////////////////////////////// TLV LOG FUNCTIONS ABOVE //////////////////////////////
+////////////////////////////// TLV CURSOR FUNCTIONS BELOW //////////////////////////////
+
+/*
+ * cursor: walks a subtree by parent and subling pointers, so it
+ * needs no stack and allocates nothing. it lives on the caller's
+ * stack and its functions are inline, fit for hot loops:
+ *
+ *     tlv_cursor c;
+ *     for (tlv_cursor_init(&c, t, t->root, TLV_CURSOR_PREORDER);
+ *          c.node; tlv_cursor_next(&c))
+ *     {
+ *         // c.node at depth c.depth, break to stop early
+ *     }
+ *
+ * the tree should not be edited while it is walked, except that in
+ * postorder c.node may be detached or destroyed after moving on
+ */
+typedef enum {
+    TLV_CURSOR_PREORDER = 0x00, // node before its children
+    TLV_CURSOR_POSTORDER = 0x01, // node after its children
+    // lazy nodes are visited as they are, their children are
+    // neither materialized nor walked
+    TLV_CURSOR_SHALLOW = 0x02
+} tlv_cursor_mode_t;
+
+// bit of tlvnode flags: children not materialized yet
+#define TLV_NODE_FLAG_LAZY (0x20)
+
+typedef struct tlv_cursor {
+    tlv* tlv;
+    tlvnode* top; // root of the subtree walked, never left
+    tlvnode* node; // current node, NULL when the walk is over
+    size_t depth; // of node below top
+    int mode; // tlv_cursor_mode_t bits
+    int skip; // see tlv_cursor_skip
+} tlv_cursor;
+
+/*
+ * returns: first child of node, materialized unless the cursor is shallow
+ */
+static inline tlvnode* tlv_cursor_child(const tlv_cursor* c, tlvnode* node)
+{
+    if (node->flags & TLV_NODE_FLAG_LAZY)
+    {
+        return (c->mode & TLV_CURSOR_SHALLOW) ? NULL : tlv_node_first_child(c->tlv, node);
+    }
+
+    return node->firstChild;
+}
+
+/*
+ * go down to the first node in postorder of the subtree of c->node
+ */
+static inline void tlv_cursor_descend(tlv_cursor* c)
+{
+    tlvnode* child;
+
+    while ((child = tlv_cursor_child(c, c->node)) != NULL)
+    {
+        c->node = child;
+        c->depth++;
+    }
+}
+
+/*
+ * start a walk of top and its subtree, mode is an order
+ * with TLV_CURSOR_SHALLOW or'ed in if wanted.
+ * c->node is the first node, NULL if top is NULL
+ */
+static inline void tlv_cursor_init(tlv_cursor* c, tlv* t, tlvnode* top, int mode)
+{
+    c->tlv = t;
+    c->top = top;
+    c->node = top;
+    c->depth = 0;
+    c->mode = mode;
+    c->skip = 0;
+
+    if (top && (mode & TLV_CURSOR_POSTORDER))
+    {
+        tlv_cursor_descend(c);
+    }
+}
+
+/*
+ * in preorder, have the next tlv_cursor_next pass over the children
+ * of c->node. in postorder they are behind already, it does nothing
+ */
+static inline void tlv_cursor_skip(tlv_cursor* c)
+{
+    c->skip = 1;
+}
+
+/*
+ * move on to the next node
+ * returns: the node, also in c->node, NULL when the walk is over
+ */
+static inline tlvnode* tlv_cursor_next(tlv_cursor* c)
+{
+    tlvnode* node = c->node;
+
+    if (!node)
+    {
+        return NULL;
+    }
+
+    if (c->mode & TLV_CURSOR_POSTORDER)
+    {
+        if (node == c->top)
+        {
+            c->node = NULL;
+        }
+        else if (node->nextSubling)
+        {
+            c->node = node->nextSubling;
+            tlv_cursor_descend(c);
+        }
+        else
+        {
+            c->node = node->parent;
+            c->depth--;
+        }
+
+        return c->node;
+    }
+
+    if (!c->skip)
+    {
+        tlvnode* child = tlv_cursor_child(c, node);
+
+        if (child)
+        {
+            c->node = child;
+            c->depth++;
+            return child;
+        }
+    }
+
+    c->skip = 0;
+
+    // climb until a subling is left, but never above top
+    while (node != c->top)
+    {
+        if (node->nextSubling)
+        {
+            c->node = node->nextSubling;
+            return c->node;
+        }
+
+        node = node->parent;
+        c->depth--;
+    }
+
+    c->node = NULL;
+    return NULL;
+}
+
+
+////////////////////////////// TLV CURSOR FUNCTIONS ABOVE //////////////////////////////
 
 #endif // __TLV_H